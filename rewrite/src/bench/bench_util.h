@@ -0,0 +1,218 @@
+// Helpers shared by the benchmarks and load tests in this directory.
+//
+// Each tool is given the paths of the im_server and load_balancer binaries it
+// needs (CMake passes them under ctest), starts them on loopback with a
+// scratch dir under the temp directory, drives it, and stops it again.
+// Process output goes to server-<port>.log and balancer.log in the scratch
+// dir. Tools with a pass/fail check exit 1 when it fails.
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int BENCH_LB_PORT = 1234; // load_balancer always listens here
+static const char *BENCH_HOST = "127.0.0.1";
+
+struct BenchProcess
+{
+    PROCESS_INFORMATION info{};
+    bool running = false;
+};
+
+// a fresh, empty directory for one run of a tool
+inline std::filesystem::path benchScratchDir(const std::string &tool)
+{
+    std::error_code ec;
+    auto dir = std::filesystem::temp_directory_path(ec) / ("im_bench_" + tool);
+    std::filesystem::remove_all(dir, ec);
+    std::filesystem::create_directories(dir, ec);
+    return dir;
+}
+
+// runs cmdLine with its output sent to logPath
+inline bool benchStart(const std::string &cmdLine, const std::filesystem::path &logPath, BenchProcess &p)
+{
+    SECURITY_ATTRIBUTES sa{sizeof(sa), nullptr, TRUE};
+    HANDLE log = CreateFileA(logPath.string().c_str(), GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+    STARTUPINFOA si{};
+    si.cb = sizeof(si);
+    if (log != INVALID_HANDLE_VALUE)
+    {
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdOutput = log;
+        si.hStdError = log;
+    }
+    std::vector<char> cmd(cmdLine.begin(), cmdLine.end());
+    cmd.push_back('\0');
+    p.running = CreateProcessA(nullptr, cmd.data(), nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr,
+                               &si, &p.info) != 0;
+    if (log != INVALID_HANDLE_VALUE)
+        CloseHandle(log);
+    return p.running;
+}
+
+inline void benchStop(BenchProcess &p)
+{
+    if (!p.running)
+        return;
+    TerminateProcess(p.info.hProcess, 0);
+    WaitForSingleObject(p.info.hProcess, 5000);
+    CloseHandle(p.info.hProcess);
+    CloseHandle(p.info.hThread);
+    p.running = false;
+}
+
+// resident set (working set) of a running process, 0 if it cannot be read
+inline size_t benchRssBytes(const BenchProcess &p)
+{
+    PROCESS_MEMORY_COUNTERS pmc{};
+    pmc.cb = sizeof(pmc);
+    if (!p.running || !GetProcessMemoryInfo(p.info.hProcess, &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.WorkingSetSize;
+}
+
+inline std::string benchQuote(const std::string &s)
+{
+    return "\"" + s + "\"";
+}
+
+// starts im_server on tcpPort/udpPort; extraArgs go after the data dir
+inline bool benchStartServer(const std::string &exe, int tcpPort, int udpPort, const std::filesystem::path &dataDir,
+                             const std::string &extraArgs, BenchProcess &p)
+{
+    std::string cmd = benchQuote(exe) + " " + std::to_string(tcpPort) + " " + std::to_string(udpPort) + " " +
+                      benchQuote(dataDir.string()) + (extraArgs.empty() ? "" : " " + extraArgs);
+    return benchStart(cmd, dataDir.parent_path() / ("server-" + std::to_string(tcpPort) + ".log"), p);
+}
+
+// writes a backends file listing 127.0.0.1:<port> for each port
+inline bool benchWriteBackends(const std::filesystem::path &path, const std::vector<int> &ports)
+{
+    std::ofstream ofs(path, std::ios::trunc);
+    for (int port : ports)
+        ofs << BENCH_HOST << " " << port << "\n";
+    return (bool)ofs;
+}
+
+inline bool benchStartBalancer(const std::string &exe, const std::filesystem::path &config,
+                               const std::string &extraArgs, BenchProcess &p)
+{
+    std::string cmd = benchQuote(exe) + " " + benchQuote(config.string()) + (extraArgs.empty() ? "" : " " + extraArgs);
+    return benchStart(cmd, config.parent_path() / "balancer.log", p);
+}
+
+// the balancer limits each source IP to 50 new connections a second and 32
+// open ones, so tools that stand in for many clients connect from
+// 127.1.x.y: source n (from 1) picks one of 62,500 loopback addresses.
+// source 0 leaves the choice to the system (127.0.0.1).
+inline bool benchBindSource(SOCKET s, uint32_t source)
+{
+    if (source == 0)
+        return true;
+    uint32_t n = (source - 1) % 62500;
+    std::string ip = "127.1." + std::to_string(n / 250) + "." + std::to_string(n % 250 + 1);
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    inet_pton(AF_INET, ip.c_str(), &local.sin_addr);
+    return bind(s, (sockaddr *)&local, sizeof(local)) != SOCKET_ERROR;
+}
+
+inline SOCKET benchConnect(int port, uint32_t source = 0)
+{
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+        return s;
+    if (!benchBindSource(s, source))
+    {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, BENCH_HOST, &addr.sin_addr);
+    if (connect(s, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+// waits until something accepts on port
+inline bool benchWaitForPort(int port, std::chrono::milliseconds timeout = std::chrono::seconds(10))
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        SOCKET s = benchConnect(port);
+        if (s != INVALID_SOCKET)
+        {
+            closesocket(s);
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+inline bool benchSendAll(SOCKET s, const std::string &data)
+{
+    size_t off = 0;
+    while (off < data.size())
+    {
+        int n = send(s, data.data() + off, (int)(data.size() - off), 0);
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+// one request on a fresh connection; reply is everything until the peer closes
+inline bool benchRequest(int port, const std::string &line, std::string &reply, uint32_t source = 0)
+{
+    reply.clear();
+    SOCKET s = benchConnect(port, source);
+    if (s == INVALID_SOCKET)
+        return false;
+    bool ok = benchSendAll(s, line + "\n");
+    char buf[4096];
+    int n;
+    while (ok && (n = recv(s, buf, sizeof(buf), 0)) > 0)
+        reply.append(buf, n);
+    closesocket(s);
+    return ok && !reply.empty();
+}
+
+// v is sorted in place; p in [0, 100]
+inline double benchPercentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)(p / 100 * (v.size() - 1) + 0.5);
+    return v[std::min(i, v.size() - 1)];
+}
+
+inline double benchMicros(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double, std::micro>(d).count();
+}
@@ -0,0 +1,127 @@
+// Chat throughput across 500 concurrent chats.
+//
+// Runs two ChatEngines in this process, on loopback. One opens CHATS chats to
+// the other, which accepts them all; sender threads then push messages into
+// every chat round-robin while the receiving side drains its MESSAGE events.
+// Prints messages per second end to end. Needs no server or balancer:
+//
+//   chat_500 [messages per chat] [message bytes]
+//
+// defaults are 2,000 messages of 100 bytes per chat; ctest runs a shorter
+// pass. Every message must arrive, in order, within its chat.
+
+#include "bench_util.h"
+#include "../chat_engine.h"
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+static const int RECEIVER_PORT = 5121;
+static const int SENDER_PORT = 5122;
+static const int CHATS = 500;
+static const int SENDER_THREADS = 8;
+
+int main(int argc, char *argv[])
+{
+    int perChat = argc > 1 ? stoi(argv[1]) : 2000;
+    size_t bytes = argc > 2 ? stoul(argv[2]) : 100;
+    uint64_t total = (uint64_t)perChat * CHATS;
+
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    ChatEngine receiver, sender;
+    if (!receiver.start(RECEIVER_PORT) || !sender.start(SENDER_PORT))
+    {
+        cout << "FAIL: could not listen on ports " << RECEIVER_PORT << " and " << SENDER_PORT << "\n";
+        return 1;
+    }
+
+    // the receiving side accepts every chat and checks that each one's
+    // messages count up from 0. only this thread touches next.
+    atomic<uint64_t> received{0}, misordered{0};
+    atomic<bool> stop{false};
+    thread events([&] {
+        unordered_map<int, int> next;
+        ChatEvent ev;
+        string text;
+        while (!stop)
+        {
+            if (!receiver.nextEvent(ev, 100))
+                continue;
+            if (ev.type == ChatEvent::INCOMING)
+                receiver.acceptChat(ev.chat);
+            else if (ev.type == ChatEvent::MESSAGE)
+            {
+                while (receiver.receiveMessage(ev.chat, text))
+                {
+                    if (stoi(text) != next[ev.chat]++)
+                        misordered++;
+                    received++;
+                }
+            }
+        }
+    });
+
+    vector<int> chats;
+    for (int i = 0; i < CHATS; i++)
+    {
+        int chat = sender.openChat(BENCH_HOST, RECEIVER_PORT);
+        if (chat == 0 || !sender.waitOpen(chat, 5000))
+        {
+            cout << "FAIL: chat " << i << " was not accepted\n";
+            stop = true;
+            events.join();
+            return 1;
+        }
+        chats.push_back(chat);
+    }
+
+    // each sender thread owns every SENDER_THREADS-th chat
+    atomic<uint64_t> failed{0};
+    auto start = chrono::steady_clock::now();
+    vector<thread> senders;
+    for (int t = 0; t < SENDER_THREADS; t++)
+    {
+        senders.emplace_back([&, t] {
+            for (int k = 0; k < perChat; k++)
+            {
+                string text = to_string(k);
+                text.resize(max(bytes, text.size() + 1), ' ');
+                for (size_t i = t; i < chats.size(); i += SENDER_THREADS)
+                {
+                    if (sender.sendMessage(chats[i], text) == 0)
+                        failed++;
+                }
+            }
+        });
+    }
+    for (auto &s : senders)
+        s.join();
+
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(60);
+    while (received + failed < total && chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    auto elapsed = chrono::steady_clock::now() - start;
+    stop = true;
+    events.join();
+
+    double seconds = chrono::duration<double>(elapsed).count();
+    cout << CHATS << " chats, " << received.load() << " of " << total << " messages of " << bytes << " bytes in "
+         << seconds << " s: " << (uint64_t)(received / seconds) << " msgs/s\n";
+    cout << failed.load() << " sends failed, " << misordered.load() << " messages out of order\n";
+
+    sender.stop();
+    receiver.stop();
+
+    bool ok = received == total && failed == 0 && misordered == 0;
+    cout << (ok ? "PASS" : "FAIL") << "\n";
+    WSACleanup();
+    return ok ? 0 : 1;
+}
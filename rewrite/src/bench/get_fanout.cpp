@@ -0,0 +1,190 @@
+// GET fan-out benchmark on 1,000-buddy lists.
+//
+// Starts one im_server and gives LISTS users a list of the same BUDDIES
+// users, half of whom are marked online with SET. It then times UDP GET
+// replies and full GETP walks (every page from cursor 0 with since = 0) for
+// those lists, one request at a time, and prints the latency percentiles and
+// request rate of each. Run it against two server builds to compare them:
+//
+//   get_fanout <im_server> [requests]
+//
+// requests defaults to 20,000 GETs and as many GETP walks; ctest runs a
+// shorter pass. Every reply must list all BUDDIES entries, or the run fails.
+
+#include "bench_util.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const int SERVER_TCP_PORT = 5111;
+static const int SERVER_UDP_PORT = 6111;
+static const int LISTS = 16;
+static const int BUDDIES = 1000;
+
+static string listerName(int i)
+{
+    return "fanl" + to_string(i % LISTS);
+}
+
+static string buddyName(int i)
+{
+    return "fanb" + to_string(i);
+}
+
+static bool setUp(SOCKET udp, const sockaddr_in &server)
+{
+    string reply, buddies, listers;
+    for (int i = 0; i < BUDDIES; i++)
+        buddies += " " + buddyName(i);
+    for (int i = 0; i < LISTS; i++)
+        listers += " " + listerName(i);
+    if (!benchRequest(SERVER_TCP_PORT, "MREG" + buddies + listers, reply) || reply.compare(0, 6, "200 OK") != 0)
+        return false;
+    for (int i = 0; i < LISTS; i++)
+    {
+        if (!benchRequest(SERVER_TCP_PORT, "MADD " + listerName(i) + buddies, reply) || reply.compare(0, 6, "200 OK") != 0)
+            return false;
+    }
+    for (int i = 0; i < BUDDIES; i += 2)
+    {
+        string set = "SET " + buddyName(i) + " 100 ONLINE " + to_string(7000 + i);
+        sendto(udp, set.c_str(), (int)set.size(), 0, (sockaddr *)&server, sizeof(server));
+    }
+    return true;
+}
+
+static bool udpRequest(SOCKET s, const sockaddr_in &server, const string &line, vector<char> &buf, string &reply)
+{
+    if (sendto(s, line.c_str(), (int)line.size(), 0, (sockaddr *)&server, sizeof(server)) == SOCKET_ERROR)
+        return false;
+    int n = recv(s, buf.data(), (int)buf.size(), 0);
+    if (n <= 0)
+        return false;
+    reply.assign(buf.data(), n);
+    return true;
+}
+
+static size_t countEntries(const string &body)
+{
+    if (body.empty())
+        return 0;
+    size_t lines = count(body.begin(), body.end(), '\n');
+    return body.back() == '\n' ? lines : lines + 1;
+}
+
+// one full GETP walk; false if a page is lost or the walk does not add up
+static bool getpWalk(SOCKET s, const sockaddr_in &server, const string &user, vector<char> &buf, int &pages)
+{
+    string reply, next = "0";
+    size_t entries = 0;
+    pages = 0;
+    while (next != "END")
+    {
+        if (!udpRequest(s, server, "GETP " + user + " " + next + " 0", buf, reply))
+            return false;
+        size_t eol = reply.find('\n');
+        if (eol == string::npos)
+            return false;
+        istringstream header(reply.substr(0, eol));
+        string page, kind, version, cursor;
+        header >> page >> kind >> version >> cursor >> next;
+        if (page != "PAGE" || next.empty())
+            return false;
+        entries += countEntries(reply.substr(eol + 1));
+        pages++;
+    }
+    return entries == BUDDIES;
+}
+
+static void report(const char *name, vector<double> &micros, chrono::steady_clock::duration elapsed)
+{
+    double seconds = chrono::duration<double>(elapsed).count();
+    double mean = 0;
+    for (double m : micros)
+        mean += m;
+    mean = micros.empty() ? 0 : mean / micros.size();
+    cout << name << ": " << micros.size() << " requests, " << (size_t)(micros.size() / seconds) << "/s, mean "
+         << (size_t)mean << " us, p50 " << (size_t)benchPercentile(micros, 50) << " us, p99 "
+         << (size_t)benchPercentile(micros, 99) << " us\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cout << "usage: get_fanout <im_server> [requests]\n";
+        return 2;
+    }
+    int total = argc > 2 ? stoi(argv[2]) : 20000;
+
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    SOCKET udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    DWORD timeoutMs = 1000;
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeoutMs, sizeof(timeoutMs));
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(SERVER_UDP_PORT);
+    inet_pton(AF_INET, BENCH_HOST, &server.sin_addr);
+
+    auto dir = benchScratchDir("get_fanout");
+    BenchProcess proc;
+    if (!benchStartServer(argv[1], SERVER_TCP_PORT, SERVER_UDP_PORT, dir / "data", "", proc) ||
+        !benchWaitForPort(SERVER_TCP_PORT) || !setUp(udp, server))
+    {
+        cout << "FAIL: could not start and populate the server (log in " << dir.string() << ")\n";
+        benchStop(proc);
+        return 1;
+    }
+
+    vector<char> buf(64 * 1024);
+    string reply;
+    int failed = 0, pages = 0;
+
+    // one untimed pass loads every list and warms the caches
+    for (int i = 0; i < LISTS; i++)
+        udpRequest(udp, server, "GET " + listerName(i), buf, reply);
+
+    vector<double> getMicros;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < total; i++)
+    {
+        auto sent = chrono::steady_clock::now();
+        if (!udpRequest(udp, server, "GET " + listerName(i), buf, reply) || countEntries(reply) != BUDDIES)
+        {
+            failed++;
+            continue;
+        }
+        getMicros.push_back(benchMicros(chrono::steady_clock::now() - sent));
+    }
+    report("GET", getMicros, chrono::steady_clock::now() - start);
+
+    vector<double> walkMicros;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < total; i++)
+    {
+        auto sent = chrono::steady_clock::now();
+        if (!getpWalk(udp, server, listerName(i), buf, pages))
+        {
+            failed++;
+            continue;
+        }
+        walkMicros.push_back(benchMicros(chrono::steady_clock::now() - sent));
+    }
+    report("GETP walk", walkMicros, chrono::steady_clock::now() - start);
+    cout << "(" << pages << " pages per walk)\n";
+
+    closesocket(udp);
+    benchStop(proc);
+
+    cout << failed << " of " << 2 * total << " GETs and walks failed\n";
+    cout << (failed == 0 ? "PASS" : "FAIL") << "\n";
+    WSACleanup();
+    return failed == 0 ? 0 : 1;
+}
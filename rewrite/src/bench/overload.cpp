@@ -0,0 +1,196 @@
+// Overload benchmark for the balancer's admission control.
+//
+// Starts one im_server behind load_balancer. Well-behaved clients send paced
+// WATCHERS requests from many loopback addresses for the whole run and
+// record their latency. After the first third, a misbehaving fleet joins:
+// FLOOD_THREADS threads hammering requests from FLOOD_SOURCES addresses as
+// fast as they can, and one address opening IDLE_CONNECTIONS connections
+// that never send anything. The balancer should shed the fleet (204 BUSY or
+// a closed connection) while the well-behaved clients stay within the SLO:
+// at least SLO_SUCCESS of their requests answered, with p99 under SLO_P99.
+//
+//   overload <im_server> <load_balancer> [seconds]
+//
+// seconds defaults to 30; ctest runs a shorter pass.
+
+#include "bench_util.h"
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int SERVER_TCP_PORT = 5141;
+static const int SERVER_UDP_PORT = 6141;
+static const int USERS = 64;
+static const int BUDDIES = 16;
+
+static const int GOOD_THREADS = 4;
+static const uint32_t GOOD_SOURCES = 400; // per thread; each stays far below the per-IP rate
+static const auto GOOD_PACE = chrono::milliseconds(5);
+static const int FLOOD_THREADS = 64;
+static const uint32_t FLOOD_SOURCES = 8;
+static const int IDLE_CONNECTIONS = 200;
+
+static const double SLO_SUCCESS = 0.99;
+static const double SLO_P99_MS = 250;
+
+// sources 1..FLOOD_SOURCES flood, the next one idles, good clients use the rest
+static const uint32_t IDLE_SOURCE = FLOOD_SOURCES + 1;
+static const uint32_t GOOD_SOURCE_BASE = IDLE_SOURCE + 1;
+
+static string userName(int i)
+{
+    return "load" + to_string(i % USERS);
+}
+
+static bool setUp()
+{
+    string reply, ids;
+    for (int i = 0; i < USERS; i++)
+        ids += " " + userName(i);
+    if (!benchRequest(BENCH_LB_PORT, "MREG" + ids, reply))
+        return false;
+    for (int i = 0; i < USERS; i++)
+    {
+        string buddies;
+        for (int k = 1; k <= BUDDIES; k++)
+            buddies += " " + userName(i + k);
+        if (!benchRequest(BENCH_LB_PORT, "MADD " + userName(i) + buddies, reply) || reply.compare(0, 6, "200 OK") != 0)
+            return false;
+    }
+    return true;
+}
+
+struct GoodStats
+{
+    mutex m;
+    vector<double> micros;
+    uint64_t sent = 0, failed = 0;
+};
+
+static void reportGood(const char *phase, GoodStats &s)
+{
+    lock_guard<mutex> lock(s.m);
+    double p50 = benchPercentile(s.micros, 50) / 1000, p99 = benchPercentile(s.micros, 99) / 1000;
+    cout << phase << ": " << s.sent << " requests, " << s.failed << " failed, p50 " << p50 << " ms, p99 " << p99
+         << " ms\n";
+}
+
+static bool withinSlo(GoodStats &s)
+{
+    lock_guard<mutex> lock(s.m);
+    return s.sent > 0 && (double)(s.sent - s.failed) / s.sent >= SLO_SUCCESS &&
+           benchPercentile(s.micros, 99) / 1000 <= SLO_P99_MS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cout << "usage: overload <im_server> <load_balancer> [seconds]\n";
+        return 2;
+    }
+    int seconds = argc > 3 ? stoi(argv[3]) : 30;
+
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    auto dir = benchScratchDir("overload");
+    BenchProcess server, balancer;
+    benchWriteBackends(dir / "backends.conf", {SERVER_TCP_PORT});
+    if (!benchStartServer(argv[1], SERVER_TCP_PORT, SERVER_UDP_PORT, dir / "data", "", server) ||
+        !benchWaitForPort(SERVER_TCP_PORT) || !benchStartBalancer(argv[2], dir / "backends.conf", "", balancer) ||
+        !benchWaitForPort(BENCH_LB_PORT) || !setUp())
+    {
+        cout << "FAIL: could not start the server and balancer (logs in " << dir.string() << ")\n";
+        benchStop(balancer);
+        benchStop(server);
+        return 1;
+    }
+
+    // good clients record into calm until the fleet arrives, then into loaded
+    GoodStats calm, loaded;
+    atomic<bool> flooding{false}, stop{false};
+    vector<thread> good;
+    for (int t = 0; t < GOOD_THREADS; t++)
+    {
+        good.emplace_back([&, t] {
+            string reply;
+            for (uint32_t i = 0; !stop; i++)
+            {
+                GoodStats &stats = flooding ? loaded : calm;
+                uint32_t source = GOOD_SOURCE_BASE + t * GOOD_SOURCES + i % GOOD_SOURCES;
+                auto sent = chrono::steady_clock::now();
+                bool ok = benchRequest(BENCH_LB_PORT, "WATCHERS " + userName((int)i), reply, source) &&
+                          reply.compare(0, 3, "200") == 0;
+                double micros = benchMicros(chrono::steady_clock::now() - sent);
+                {
+                    lock_guard<mutex> lock(stats.m);
+                    stats.sent++;
+                    if (ok)
+                        stats.micros.push_back(micros);
+                    else
+                        stats.failed++;
+                }
+                this_thread::sleep_for(GOOD_PACE);
+            }
+        });
+    }
+
+    auto phase = chrono::milliseconds(seconds * 1000 / 3);
+    this_thread::sleep_for(phase);
+    flooding = true;
+
+    atomic<uint64_t> floodServed{0}, floodShed{0};
+    vector<thread> flood;
+    for (int t = 0; t < FLOOD_THREADS; t++)
+    {
+        flood.emplace_back([&, t] {
+            string reply;
+            for (uint32_t i = t; !stop; i += FLOOD_THREADS)
+            {
+                bool ok = benchRequest(BENCH_LB_PORT, "WATCHERS " + userName((int)i), reply, 1 + i % FLOOD_SOURCES) &&
+                          reply.compare(0, 3, "200") == 0;
+                (ok ? floodServed : floodShed)++;
+            }
+        });
+    }
+
+    // connections that never send; the balancer keeps at most its per-IP
+    // limit of them and drops those after its first-bytes deadline
+    vector<SOCKET> idle;
+    for (int i = 0; i < IDLE_CONNECTIONS; i++)
+    {
+        SOCKET s = benchConnect(BENCH_LB_PORT, IDLE_SOURCE);
+        if (s != INVALID_SOCKET)
+            idle.push_back(s);
+    }
+
+    this_thread::sleep_for(2 * phase);
+    stop = true;
+    for (auto &t : flood)
+        t.join();
+    for (auto &t : good)
+        t.join();
+    for (SOCKET s : idle)
+        closesocket(s);
+    benchStop(balancer);
+    benchStop(server);
+
+    reportGood("good clients, calm", calm);
+    reportGood("good clients, under flood", loaded);
+    uint64_t floodTotal = floodServed + floodShed;
+    cout << "flood: " << floodTotal << " requests, " << floodServed.load() << " served, " << floodShed.load()
+         << " shed\n";
+    cout << "SLO: " << SLO_SUCCESS * 100 << "% answered, p99 under " << SLO_P99_MS << " ms\n";
+
+    bool ok = withinSlo(calm) && withinSlo(loaded) && floodShed > 0;
+    cout << (ok ? "PASS" : "FAIL") << "\n";
+    WSACleanup();
+    return ok ? 0 : 1;
+}
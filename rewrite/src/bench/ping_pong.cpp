@@ -0,0 +1,141 @@
+// Ping-pong latency, default mode against --low-latency.
+//
+// Runs the same two measurements twice: once with im_server and
+// load_balancer started normally, and once with both in low-latency mode on
+// the given cores. Each measurement has exactly one request in flight:
+//
+//   SET/GET  a UDP SET for one user, then a GET of a buddy list that holds
+//            that user, timed until the GET reply arrives
+//   TCP      a MUTUAL request through the balancer on a fresh connection,
+//            timed from connect until the reply has been read
+//
+// and prints p50, p99 and p99.9 for each. Nothing else runs meanwhile, so
+// pick cores the rest of the machine leaves alone.
+//
+//   ping_pong <im_server> <load_balancer> [round trips] [server cores] [balancer cores]
+//
+// defaults are 20,000 round trips, server core 1 and balancer cores 2,3;
+// ctest runs a shorter pass. Every request must be answered, or the run fails.
+
+#include "bench_util.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const int SERVER_TCP_PORT = 5151;
+static const int SERVER_UDP_PORT = 6151;
+static const int WARMUP = 200;
+
+struct ModeResult
+{
+    vector<double> udpMicros, tcpMicros;
+    int lost = 0;
+};
+
+static bool setUp()
+{
+    string reply;
+    return benchRequest(BENCH_LB_PORT, "MREG pingA pingB", reply) &&
+           benchRequest(BENCH_LB_PORT, "ADD pingA pingB", reply) && reply.compare(0, 6, "200 OK") == 0 &&
+           benchRequest(BENCH_LB_PORT, "ADD pingB pingA", reply) && reply.compare(0, 6, "200 OK") == 0;
+}
+
+static bool runMode(const string &serverExe, const string &lbExe, const string &serverArgs, const string &lbArgs,
+                    int trips, ModeResult &result)
+{
+    auto dir = benchScratchDir("ping_pong");
+    BenchProcess server, balancer;
+    benchWriteBackends(dir / "backends.conf", {SERVER_TCP_PORT});
+    bool started = benchStartServer(serverExe, SERVER_TCP_PORT, SERVER_UDP_PORT, dir / "data", serverArgs, server) &&
+                   benchWaitForPort(SERVER_TCP_PORT) &&
+                   benchStartBalancer(lbExe, dir / "backends.conf", lbArgs, balancer) &&
+                   benchWaitForPort(BENCH_LB_PORT) && setUp();
+    if (!started)
+    {
+        cout << "FAIL: could not start the server and balancer (logs in " << dir.string() << ")\n";
+        benchStop(balancer);
+        benchStop(server);
+        return false;
+    }
+
+    SOCKET udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    DWORD timeoutMs = 1000;
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeoutMs, sizeof(timeoutMs));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_UDP_PORT);
+    inet_pton(AF_INET, BENCH_HOST, &addr.sin_addr);
+
+    char buf[8192];
+    string get = "GET pingB";
+    for (int i = -WARMUP; i < trips; i++)
+    {
+        string set = "SET pingA " + string(i % 2 ? "100 ONLINE" : "102 AWAY") + " 7000";
+        auto sent = chrono::steady_clock::now();
+        sendto(udp, set.c_str(), (int)set.size(), 0, (sockaddr *)&addr, sizeof(addr));
+        sendto(udp, get.c_str(), (int)get.size(), 0, (sockaddr *)&addr, sizeof(addr));
+        if (recv(udp, buf, sizeof(buf), 0) <= 0)
+            result.lost++;
+        else if (i >= 0)
+            result.udpMicros.push_back(benchMicros(chrono::steady_clock::now() - sent));
+    }
+    closesocket(udp);
+
+    // rotating sources keep the balancer's per-IP rate limit out of the numbers
+    string reply;
+    for (int i = -WARMUP; i < trips; i++)
+    {
+        auto sent = chrono::steady_clock::now();
+        if (!benchRequest(BENCH_LB_PORT, "MUTUAL pingA pingB", reply, (uint32_t)(i + WARMUP + 1)) ||
+            reply.compare(0, 3, "200") != 0)
+            result.lost++;
+        else if (i >= 0)
+            result.tcpMicros.push_back(benchMicros(chrono::steady_clock::now() - sent));
+    }
+
+    benchStop(balancer);
+    benchStop(server);
+    return true;
+}
+
+static void report(const char *name, vector<double> &micros)
+{
+    cout << "  " << name << ": p50 " << benchPercentile(micros, 50) << " us, p99 " << benchPercentile(micros, 99)
+         << " us, p99.9 " << benchPercentile(micros, 99.9) << " us\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cout << "usage: ping_pong <im_server> <load_balancer> [round trips] [server cores] [balancer cores]\n";
+        return 2;
+    }
+    int trips = argc > 3 ? stoi(argv[3]) : 20000;
+    string serverCores = argc > 4 ? argv[4] : "1";
+    string lbCores = argc > 5 ? argv[5] : "2,3";
+
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    ModeResult normal, lowLatency;
+    if (!runMode(argv[1], argv[2], "", "", trips, normal) ||
+        !runMode(argv[1], argv[2], "--low-latency " + serverCores, "--low-latency " + lbCores, trips, lowLatency))
+        return 1;
+
+    cout << "default mode, " << trips << " round trips each\n";
+    report("SET/GET", normal.udpMicros);
+    report("TCP    ", normal.tcpMicros);
+    cout << "low-latency mode (server cores " << serverCores << ", balancer cores " << lbCores << ")\n";
+    report("SET/GET", lowLatency.udpMicros);
+    report("TCP    ", lowLatency.tcpMicros);
+
+    int lost = normal.lost + lowLatency.lost;
+    cout << lost << " requests went unanswered\n";
+    cout << (lost == 0 ? "PASS" : "FAIL") << "\n";
+    WSACleanup();
+    return lost == 0 ? 0 : 1;
+}
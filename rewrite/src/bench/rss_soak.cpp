@@ -0,0 +1,175 @@
+// RSS soak test for connection churn.
+//
+// Starts one im_server behind load_balancer and pushes short TCP requests
+// through the balancer from several threads, one connection each: WATCHERS,
+// MUTUAL and FETCH, plus an ADD/DEL pair now and then so buddy lists are
+// read and rewritten. A UDP thread polls GET alongside. Connections come
+// from rotating loopback addresses, so the per-IP limits never shed them.
+// The resident set of both processes is sampled as the connection count
+// grows. Once the first tenth of the run has warmed up the pools, arenas and
+// worker threads, neither process may grow by more than 10% plus 4 MB.
+//
+//   rss_soak <im_server> <load_balancer> [connections]
+//
+// connections defaults to 2,000,000; ctest runs a shorter pass.
+
+#include "bench_util.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int SERVER_TCP_PORT = 5101;
+static const int SERVER_UDP_PORT = 6101;
+static const int USERS = 64;
+static const int BUDDIES = 32;
+static const int CLIENT_THREADS = 8;
+static const int SAMPLES = 50;
+
+static string userName(int i)
+{
+    return "soak" + to_string(i % USERS);
+}
+
+// every user has the next BUDDIES users on their list
+static bool setUp()
+{
+    string reply, ids;
+    for (int i = 0; i < USERS; i++)
+        ids += " " + userName(i);
+    if (!benchRequest(BENCH_LB_PORT, "MREG" + ids, reply))
+        return false;
+    for (int i = 0; i < USERS; i++)
+    {
+        string buddies;
+        for (int k = 1; k <= BUDDIES; k++)
+            buddies += " " + userName(i + k);
+        if (!benchRequest(BENCH_LB_PORT, "MADD " + userName(i) + buddies, reply) || reply.compare(0, 6, "200 OK") != 0)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cout << "usage: rss_soak <im_server> <load_balancer> [connections]\n";
+        return 2;
+    }
+    uint64_t total = argc > 3 ? stoull(argv[3]) : 2000000;
+
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    auto dir = benchScratchDir("rss_soak");
+    BenchProcess server, balancer;
+    benchWriteBackends(dir / "backends.conf", {SERVER_TCP_PORT});
+    if (!benchStartServer(argv[1], SERVER_TCP_PORT, SERVER_UDP_PORT, dir / "data", "", server) ||
+        !benchWaitForPort(SERVER_TCP_PORT) || !benchStartBalancer(argv[2], dir / "backends.conf", "", balancer) ||
+        !benchWaitForPort(BENCH_LB_PORT) || !setUp())
+    {
+        cout << "FAIL: could not start the server and balancer (logs in " << dir.string() << ")\n";
+        benchStop(balancer);
+        benchStop(server);
+        return 1;
+    }
+
+    atomic<uint64_t> next{0}, done{0}, failed{0};
+    atomic<bool> stop{false};
+
+    vector<thread> clients;
+    for (int t = 0; t < CLIENT_THREADS; t++)
+    {
+        clients.emplace_back([&, t] {
+            // this thread's user toggles one buddy that is not on the list
+            string user = userName(t), extra = userName(t + BUDDIES + 8);
+            bool added = false;
+            string reply;
+            for (uint64_t i; (i = next++) < total;)
+            {
+                string line;
+                switch (i % 16)
+                {
+                case 0:
+                    line = (added ? "DEL " : "ADD ") + user + " " + extra;
+                    added = !added;
+                    break;
+                case 1:
+                    line = "FETCH " + userName((int)i);
+                    break;
+                case 2:
+                case 3:
+                    line = "MUTUAL " + userName((int)i) + " " + userName((int)i + 1);
+                    break;
+                default:
+                    line = "WATCHERS " + userName((int)i);
+                }
+                if (!benchRequest(BENCH_LB_PORT, line, reply, (uint32_t)i + 1) || reply.compare(0, 3, "200") != 0)
+                    failed++;
+                done++;
+            }
+        });
+    }
+
+    thread poller([&] {
+        SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        DWORD timeoutMs = 500;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeoutMs, sizeof(timeoutMs));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(SERVER_UDP_PORT);
+        inet_pton(AF_INET, BENCH_HOST, &addr.sin_addr);
+        char buf[8192];
+        for (int i = 0; !stop; i++)
+        {
+            string get = "GET " + userName(i);
+            sendto(s, get.c_str(), (int)get.size(), 0, (sockaddr *)&addr, sizeof(addr));
+            recv(s, buf, sizeof(buf), 0);
+        }
+        closesocket(s);
+    });
+
+    // one row per SAMPLES-th of the run
+    vector<size_t> lbRss, serverRss;
+    cout << "connections  balancer_kb  server_kb\n";
+    for (int k = 1; k <= SAMPLES; k++)
+    {
+        uint64_t mark = total * k / SAMPLES;
+        while (done < mark)
+            this_thread::sleep_for(chrono::milliseconds(100));
+        lbRss.push_back(benchRssBytes(balancer));
+        serverRss.push_back(benchRssBytes(server));
+        cout << mark << "  " << lbRss.back() / 1024 << "  " << serverRss.back() / 1024 << "\n";
+    }
+
+    stop = true;
+    for (auto &c : clients)
+        c.join();
+    poller.join();
+    benchStop(balancer);
+    benchStop(server);
+
+    bool ok = true;
+    auto check = [&](const char *name, const vector<size_t> &rss) {
+        size_t warm = rss[SAMPLES / 10 - 1];
+        size_t peak = *max_element(rss.begin() + SAMPLES / 10, rss.end());
+        size_t allowed = warm + warm / 10 + 4 * 1024 * 1024;
+        cout << name << ": " << warm / 1024 << " kB after warm-up, peak " << peak / 1024 << " kB, limit "
+             << allowed / 1024 << " kB\n";
+        ok = ok && warm > 0 && peak <= allowed;
+    };
+    check("balancer", lbRss);
+    check("server", serverRss);
+    cout << failed.load() << " of " << total << " requests failed\n";
+    ok = ok && failed == 0;
+
+    cout << (ok ? "PASS" : "FAIL") << "\n";
+    WSACleanup();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+// Scale-out and scale-in under load, with zero failed requests.
+//
+// Starts the balancer with one im_server and keeps it busy with short TCP
+// requests (WATCHERS, MUTUAL and FETCH) from several threads. A third of the
+// way in, a second server sharing the first one's data dir is started and
+// added to the backends file; two thirds in, the first server is removed
+// from it, so it drains while the second takes over. The balancer picks up
+// both edits by itself. Every request must succeed throughout, and the
+// balancer log must show both reloads.
+//
+//   scale_out <im_server> <load_balancer> [seconds]
+//
+// seconds defaults to 30; ctest runs a shorter pass.
+
+#include "bench_util.h"
+
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int FIRST_TCP_PORT = 5131;
+static const int FIRST_UDP_PORT = 6131;
+static const int SECOND_TCP_PORT = 5132;
+static const int SECOND_UDP_PORT = 6132;
+static const int USERS = 64;
+static const int BUDDIES = 16;
+static const int CLIENT_THREADS = 8;
+
+static string userName(int i)
+{
+    return "scale" + to_string(i % USERS);
+}
+
+static bool setUp()
+{
+    string reply, ids;
+    for (int i = 0; i < USERS; i++)
+        ids += " " + userName(i);
+    if (!benchRequest(BENCH_LB_PORT, "MREG" + ids, reply))
+        return false;
+    for (int i = 0; i < USERS; i++)
+    {
+        string buddies;
+        for (int k = 1; k <= BUDDIES; k++)
+            buddies += " " + userName(i + k);
+        if (!benchRequest(BENCH_LB_PORT, "MADD " + userName(i) + buddies, reply) || reply.compare(0, 6, "200 OK") != 0)
+            return false;
+    }
+    return true;
+}
+
+// how many times the balancer has installed a table of n backends
+static int reloadsTo(const filesystem::path &log, size_t n)
+{
+    ifstream in(log);
+    stringstream ss;
+    ss << in.rdbuf();
+    string text = ss.str(), needle = "Forwarding to " + to_string(n) + " backend(s)";
+    int count = 0;
+    for (size_t pos = 0; (pos = text.find(needle, pos)) != string::npos; pos += needle.size())
+        count++;
+    return count;
+}
+
+// waits until the balancer log shows a table of n backends
+static bool waitForReload(const filesystem::path &log, size_t n, int before)
+{
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (chrono::steady_clock::now() < deadline)
+    {
+        if (reloadsTo(log, n) > before)
+            return true;
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cout << "usage: scale_out <im_server> <load_balancer> [seconds]\n";
+        return 2;
+    }
+    int seconds = argc > 3 ? stoi(argv[3]) : 30;
+
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    auto dir = benchScratchDir("scale_out");
+    auto config = dir / "backends.conf";
+    auto lbLog = dir / "balancer.log";
+    BenchProcess first, second, balancer;
+    benchWriteBackends(config, {FIRST_TCP_PORT});
+    if (!benchStartServer(argv[1], FIRST_TCP_PORT, FIRST_UDP_PORT, dir / "data", "", first) ||
+        !benchWaitForPort(FIRST_TCP_PORT) || !benchStartBalancer(argv[2], config, "", balancer) ||
+        !benchWaitForPort(BENCH_LB_PORT) || !setUp())
+    {
+        cout << "FAIL: could not start the server and balancer (logs in " << dir.string() << ")\n";
+        benchStop(balancer);
+        benchStop(first);
+        return 1;
+    }
+
+    atomic<uint64_t> done{0}, failed{0};
+    atomic<bool> stop{false};
+    vector<thread> clients;
+    for (int t = 0; t < CLIENT_THREADS; t++)
+    {
+        clients.emplace_back([&, t] {
+            string reply;
+            for (uint32_t i = t; !stop; i += CLIENT_THREADS)
+            {
+                string line;
+                switch (i % 4)
+                {
+                case 0:
+                    line = "FETCH " + userName((int)i);
+                    break;
+                case 1:
+                    line = "MUTUAL " + userName((int)i) + " " + userName((int)i + 1);
+                    break;
+                default:
+                    line = "WATCHERS " + userName((int)i);
+                }
+                if (!benchRequest(BENCH_LB_PORT, line, reply, i + 1) || reply.compare(0, 3, "200") != 0)
+                    failed++;
+                done++;
+            }
+        });
+    }
+
+    auto phase = chrono::milliseconds(seconds * 1000 / 3);
+    bool ok = true;
+
+    this_thread::sleep_for(phase);
+    cout << "one backend: " << done.load() << " requests, " << failed.load() << " failed\n";
+    int before = reloadsTo(lbLog, 2);
+    if (!benchStartServer(argv[1], SECOND_TCP_PORT, SECOND_UDP_PORT, dir / "data", "", second) ||
+        !benchWaitForPort(SECOND_TCP_PORT) || !benchWriteBackends(config, {FIRST_TCP_PORT, SECOND_TCP_PORT}) ||
+        !waitForReload(lbLog, 2, before))
+    {
+        cout << "the balancer did not pick up the second backend\n";
+        ok = false;
+    }
+
+    this_thread::sleep_for(phase);
+    cout << "two backends: " << done.load() << " requests, " << failed.load() << " failed\n";
+    before = reloadsTo(lbLog, 1);
+    if (!benchWriteBackends(config, {SECOND_TCP_PORT}) || !waitForReload(lbLog, 1, before))
+    {
+        cout << "the balancer did not drop the first backend\n";
+        ok = false;
+    }
+
+    this_thread::sleep_for(phase);
+    stop = true;
+    for (auto &c : clients)
+        c.join();
+    cout << "first backend drained: " << done.load() << " requests, " << failed.load() << " failed\n";
+
+    benchStop(balancer);
+    benchStop(second);
+    benchStop(first);
+
+    ok = ok && failed == 0;
+    cout << (ok ? "PASS" : "FAIL") << "\n";
+    WSACleanup();
+    return ok ? 0 : 1;
+}
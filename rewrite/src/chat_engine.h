@@ -0,0 +1,697 @@
+// Peer-to-peer chat for im_client, with no console I/O.
+//
+// A client listens on its chat port, and a buddy who wants to talk connects
+// to it directly. ChatEngine runs every chat of one client from a single
+// reactor thread and hands incoming messages to the caller as events, so the
+// console client and the benchmarks in bench/ drive the same code.
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// What ChatEngine::nextEvent reports. MESSAGE means a chat's inbox went from
+// empty to non-empty; drain it with receiveMessage.
+struct ChatEvent
+{
+    enum Type { INCOMING, ACCEPTED, REJECTED, MESSAGE, CLOSED };
+    Type type;
+    int chat;
+};
+
+// Chat wire format. Older clients take nothing but "ACCEPT" or "REJECT" as the
+// answer and show every line after it as a message, so the handshake has to
+// look like theirs. The buddy offers framing by ending its "ACCEPT" with
+// "\r\n" instead of "\n"; older clients drop the '\r' and see a plain ACCEPT.
+// An initiator that sees the offer answers "HELLO FRAMED" and both sides
+// switch to frames. The buddy sends nothing after its answer until the
+// initiator's first line shows which kind of client it is, or until MODE_WAIT
+// passes without one (an older client whose user has not typed yet), and then
+// stays with newline-terminated lines. Frames are a 9 byte header (u32 payload length, u32 message id, u8 type, all
+// integers in network order) followed by the payload. DATA ids count up from
+// 1 per chat and direction; an ACK carries no payload and confirms every DATA
+// id up to its own.
+static const std::string CHAT_HELLO = "HELLO FRAMED";
+static const std::string CHAT_ACCEPT = "ACCEPT";
+static const std::string CHAT_REJECT = "REJECT";
+
+static const size_t FRAME_HEADER = 9;
+static const char FRAME_DATA = 'D';
+static const char FRAME_ACK = 'A';
+
+// One peer-to-peer chat. The socket is closed when the last reference goes,
+// so a send racing with the reactor dropping the chat never writes to a reused
+// descriptor.
+struct Chat
+{
+    enum State { PENDING, CONNECTING, OPEN, CLOSED };
+
+    int id;
+    SOCKET sock;
+    std::string peer;
+
+    // guarded by the engine mutex
+    State state;
+    bool offered = false; // accepted with the framing offer, no line seen yet
+    std::chrono::steady_clock::time_point modeDeadline;
+    std::deque<std::string> inbox;
+
+    std::string readBuf; // undecoded input, reactor thread only
+
+    // outgoing data, encoded and not yet taken by the socket. sock is
+    // non-blocking; whoever queues data sends what fits, and the reactor sends
+    // the rest once the socket reports POLLWRNORM.
+    std::mutex outMutex; // guards the fields below
+    std::condition_variable outCv; // outBytes dropped, or the chat failed
+    std::deque<std::string> outQueue;
+    size_t outBytes = 0;  // unsent bytes in outQueue and held
+    size_t frontSent = 0; // bytes of outQueue.front() already sent
+    bool outFailed = false;
+    uint32_t lastSentId = 0;
+    // written under both mutexes, so either one is enough to read them
+    bool framed = false;
+    bool modeKnown = true; // false while an accepted chat waits to pick a mode
+    std::deque<std::string> held; // messages sent before the mode was known
+
+    std::atomic<bool> wantWrite{false}; // socket is full; the reactor watches it
+    std::atomic<uint32_t> ackedThrough{0};
+
+    Chat(int id, SOCKET sock, const std::string& peer, State state): id(id), sock(sock), peer(peer), state(state) {}
+    ~Chat(){ closesocket(sock); }
+};
+
+// Client side of peer-to-peer chat, with no console I/O. One reactor thread
+// polls the listening socket and every chat socket with WSAPoll and queues
+// incoming lines per chat; callers send from their own thread. A loopback UDP
+// socket wakes the reactor when the chat set changes.
+//
+//   incoming: INCOMING event, then acceptChat or rejectChat
+//   outgoing: openChat, then waitOpen (or the ACCEPTED / REJECTED event)
+//   either:   sendMessage, MESSAGE events + receiveMessage, closeChat
+class ChatEngine {
+    public:
+        static const size_t MAX_CHATS = 1024;
+        static const size_t MAX_MESSAGE = 64 * 1024;
+        static const size_t MAX_BATCH = 64; // buffers per WSASend
+        static const size_t MAX_OUTBOX_BYTES = 1 << 20; // senders wait while more is unsent
+        // how long an accepted chat waits for the initiator's first line
+        // before it settles on lines; older initiators may stay silent
+        static constexpr std::chrono::milliseconds MODE_WAIT{2000};
+
+        ChatEngine(): listenSock_(INVALID_SOCKET), wakeSock_(INVALID_SOCKET), stop_(false), dirty_(true), nextId_(1) {}
+
+        ~ChatEngine(){ stop(); }
+
+        // listens for chats on port and starts the reactor
+        bool start(int port){
+            listenSock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port = htons(port);
+            if (bind(listenSock_, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listenSock_, SOMAXCONN) == SOCKET_ERROR){
+                closesocket(listenSock_);
+                listenSock_ = INVALID_SOCKET;
+                return false;
+            }
+
+            // wakeup socket: a UDP socket connected to itself
+            wakeSock_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            sockaddr_in wake{};
+            wake.sin_family = AF_INET;
+            inet_pton(AF_INET, "127.0.0.1", &wake.sin_addr);
+            int len = sizeof(wake);
+            bind(wakeSock_, (sockaddr*)&wake, sizeof(wake));
+            getsockname(wakeSock_, (sockaddr*)&wake, &len);
+            connect(wakeSock_, (sockaddr*)&wake, sizeof(wake));
+            u_long nonBlocking = 1;
+            ioctlsocket(wakeSock_, FIONBIO, &nonBlocking);
+
+            reactor_ = std::thread(&ChatEngine::reactorLoop, this);
+            return true;
+        }
+
+        void stop(){
+            if (!reactor_.joinable()) return;
+            stop_ = true;
+            wake();
+            reactor_.join();
+            closesocket(listenSock_);
+            closesocket(wakeSock_);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& [id, c]: chats_){
+                shutdown(c->sock, SD_BOTH);
+                failOutput(*c);
+            }
+            chats_.clear();
+            eventCv_.notify_all();
+        }
+
+        // connects to a buddy's chat port. returns the chat id, or 0 if the
+        // connect failed. the chat is usable once the buddy accepts.
+        int openChat(const std::string& ip, int port){
+            SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
+            addr.sin_port = htons(port);
+            if (connect(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR){
+                closesocket(s);
+                return 0;
+            }
+            int id = addChat(s, ip + ":" + std::to_string(port), Chat::CONNECTING);
+            if (id == 0) closesocket(s);
+            return id;
+        }
+
+        // waits until the buddy answers an openChat; true if they accepted
+        bool waitOpen(int chat, int timeoutMs){
+            std::unique_lock<std::mutex> lock(mutex_);
+            eventCv_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]{
+                auto it = chats_.find(chat);
+                return it == chats_.end() || it->second->state != Chat::CONNECTING;
+            });
+            auto it = chats_.find(chat);
+            return it != chats_.end() && it->second->state == Chat::OPEN;
+        }
+
+        bool acceptChat(int chat){
+            std::shared_ptr<Chat> c;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                c = findLocked(chat);
+                if (!c || c->state != Chat::PENDING) return false;
+
+                // the answer must be the first thing on the wire, so it is queued
+                // before any sender can see the chat open. a peer that already
+                // sent lines is not a framing initiator and gets a plain ACCEPT.
+                std::lock_guard<std::mutex> out(c->outMutex);
+                c->offered = c->inbox.empty();
+                queueLocked(*c, CHAT_ACCEPT + (c->offered ? "\r\n" : "\n"));
+                if (c->offered){
+                    c->modeKnown = false;
+                    c->modeDeadline = std::chrono::steady_clock::now() + MODE_WAIT;
+                    undecided_++;
+                }
+                c->state = Chat::OPEN;
+            }
+            wake(); // the reactor watches modeDeadline
+            return flush(*c);
+        }
+
+        bool rejectChat(int chat){
+            std::shared_ptr<Chat> c;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                c = findLocked(chat);
+                if (!c || c->state != Chat::PENDING) return false;
+            }
+            writeRaw(*c, CHAT_REJECT + "\n");
+            closeChat(chat);
+            return true;
+        }
+
+        // returns the message id, or 0 if the chat is gone or text is longer
+        // than MAX_MESSAGE (the buddy would drop the chat). whatever is still
+        // queued for the chat goes out in the same WSASend. waits while
+        // MAX_OUTBOX_BYTES are unsent, so a buddy who stops reading slows the
+        // sender down instead of growing the queue. in line mode (older
+        // buddies) newlines in text become spaces.
+        uint32_t sendMessage(int chat, const std::string& text){
+            return sendMessages(chat, &text, 1);
+        }
+
+        // queues count messages at once so they share one WSASend; returns the
+        // id of the last one. nothing is sent if any of them is too long.
+        uint32_t sendMessages(int chat, const std::string* texts, size_t count){
+            for (size_t i = 0; i < count; i++){
+                if (texts[i].size() > MAX_MESSAGE) return 0;
+            }
+
+            std::shared_ptr<Chat> c;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                c = findLocked(chat);
+                if (!c || c->state != Chat::OPEN) return 0;
+            }
+
+            uint32_t id = 0;
+            bool ok, parked;
+            {
+                std::unique_lock<std::mutex> lock(c->outMutex);
+                c->outCv.wait(lock, [&]{ return c->outFailed || c->outBytes < MAX_OUTBOX_BYTES; });
+                if (c->outFailed) return 0;
+                bool wasParked = c->wantWrite;
+                for (size_t i = 0; i < count; i++){
+                    id = ++c->lastSentId;
+                    if (c->modeKnown){
+                        queueLocked(*c, encodeMessage(*c, id, texts[i]));
+                    }
+                    else{
+                        // encoded once the initiator's first line picks the mode
+                        c->outBytes += texts[i].size();
+                        c->held.push_back(texts[i]);
+                    }
+                }
+                ok = sendLocked(*c);
+                parked = !wasParked && c->wantWrite;
+            }
+            if (parked) wake(); // the reactor has to start watching for POLLWRNORM
+            return ok ? id : 0;
+        }
+
+        // highest message id the buddy confirmed; stays 0 in line mode
+        uint32_t ackedThrough(int chat){
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto c = findLocked(chat);
+            return c ? c->ackedThrough.load() : 0;
+        }
+
+        // pops the oldest unread line; lines stay readable after the peer hangs up
+        bool receiveMessage(int chat, std::string& text){
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = chats_.find(chat);
+            if (it == chats_.end() || it->second->inbox.empty()) return false;
+
+            Chat& c = *it->second;
+            text = std::move(c.inbox.front());
+            c.inbox.pop_front();
+            if (c.state == Chat::CLOSED && c.inbox.empty()) chats_.erase(it);
+            return true;
+        }
+
+        // hangs up; the reactor drops the chat and reports CLOSED
+        void closeChat(int chat){
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = chats_.find(chat);
+            if (it == chats_.end()) return;
+            if (it->second->state == Chat::CLOSED) chats_.erase(it);
+            else shutdown(it->second->sock, SD_BOTH);
+        }
+
+        bool nextEvent(ChatEvent& ev, int timeoutMs){
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!eventCv_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]{ return !events_.empty(); })) return false;
+            ev = events_.front();
+            events_.pop_front();
+            return true;
+        }
+
+        // incoming chats waiting for acceptChat / rejectChat, oldest first
+        std::vector<int> pendingChats(){
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<int> ids;
+            for (auto& [id, c]: chats_){
+                if (c->state == Chat::PENDING) ids.push_back(id);
+            }
+            std::sort(ids.begin(), ids.end());
+            return ids;
+        }
+
+        std::string peerOf(int chat){
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto c = findLocked(chat);
+            return c ? c->peer : "";
+        }
+
+    private:
+        SOCKET listenSock_;
+        SOCKET wakeSock_;
+        std::thread reactor_;
+        std::atomic<bool> stop_;
+
+        std::mutex mutex_; // guards everything below
+        std::condition_variable eventCv_;
+        std::unordered_map<int, std::shared_ptr<Chat>> chats_;
+        std::deque<ChatEvent> events_;
+        bool dirty_; // chats_ changed since the reactor built its poll set
+        int undecided_ = 0; // accepted chats still waiting to pick a mode
+        int nextId_;
+
+        std::shared_ptr<Chat> findLocked(int chat){
+            auto it = chats_.find(chat);
+            return it == chats_.end() ? nullptr : it->second;
+        }
+
+        void pushEventLocked(ChatEvent::Type type, int chat){
+            events_.push_back({type, chat});
+            eventCv_.notify_all();
+        }
+
+        void wake(){
+            ::send(wakeSock_, "w", 1, 0);
+        }
+
+        int addChat(SOCKET s, const std::string& peer, Chat::State state){
+            int id;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (chats_.size() >= MAX_CHATS) return 0;
+                id = nextId_++;
+                // frames are flushed as soon as they are queued, Nagle would only delay them
+                BOOL noDelay = TRUE;
+                setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+                u_long nonBlocking = 1; // the reactor must never wait on a chat
+                ioctlsocket(s, FIONBIO, &nonBlocking);
+                chats_[id] = std::make_shared<Chat>(id, s, peer, state);
+                dirty_ = true;
+                if (state == Chat::PENDING) pushEventLocked(ChatEvent::INCOMING, id);
+            }
+            wake();
+            return id;
+        }
+
+        static std::string encodeFrame(char type, uint32_t id, const std::string& payload){
+            std::string frame(FRAME_HEADER + payload.size(), '\0');
+            uint32_t len = htonl((uint32_t)payload.size());
+            uint32_t netId = htonl(id);
+            memcpy(&frame[0], &len, 4);
+            memcpy(&frame[4], &netId, 4);
+            frame[8] = type;
+            memcpy(&frame[FRAME_HEADER], payload.data(), payload.size());
+            return frame;
+        }
+
+        // one DATA frame, or one line in line mode, where newlines in text
+        // become spaces. caller holds c.outMutex.
+        static std::string encodeMessage(const Chat& c, uint32_t id, const std::string& text){
+            if (c.framed) return encodeFrame(FRAME_DATA, id, text);
+            std::string line = text;
+            std::replace(line.begin(), line.end(), '\n', ' ');
+            return line + "\n";
+        }
+
+        static void queueLocked(Chat& c, std::string data){
+            c.outBytes += data.size();
+            c.outQueue.push_back(std::move(data));
+        }
+
+        // queues data without waiting for room; the reactor's acks go this way
+        bool writeRaw(Chat& c, std::string data){
+            {
+                std::lock_guard<std::mutex> lock(c.outMutex);
+                if (c.outFailed) return false;
+                queueLocked(c, std::move(data));
+            }
+            return flush(c);
+        }
+
+        bool flush(Chat& c){
+            bool ok, parked;
+            {
+                std::lock_guard<std::mutex> lock(c.outMutex);
+                bool wasParked = c.wantWrite;
+                ok = sendLocked(c);
+                parked = !wasParked && c.wantWrite;
+            }
+            if (parked) wake();
+            return ok;
+        }
+
+        // sends as much of outQueue as the socket takes, in vectored WSASends of
+        // up to MAX_BATCH buffers. never blocks: when the socket is full,
+        // wantWrite is set and the rest waits for the reactor. false if the
+        // connection failed. caller holds c.outMutex.
+        static bool sendLocked(Chat& c){
+            WSABUF bufs[MAX_BATCH];
+            while (!c.outQueue.empty()){
+                DWORD n = 0;
+                for (; n < MAX_BATCH && n < c.outQueue.size(); n++){
+                    bufs[n].buf = const_cast<char*>(c.outQueue[n].data());
+                    bufs[n].len = (u_long)c.outQueue[n].size();
+                }
+                bufs[0].buf += c.frontSent;
+                bufs[0].len -= (u_long)c.frontSent;
+
+                DWORD sent = 0;
+                if (WSASend(c.sock, bufs, n, &sent, 0, nullptr, nullptr) == SOCKET_ERROR){
+                    if (WSAGetLastError() == WSAEWOULDBLOCK){
+                        c.wantWrite = true;
+                        return true;
+                    }
+                    failOutputLocked(c);
+                    return false;
+                }
+
+                // drop what the socket took, possibly part of a buffer
+                c.outBytes -= sent;
+                while (sent > 0){
+                    size_t left = c.outQueue.front().size() - c.frontSent;
+                    if (sent < left){
+                        c.frontSent += sent;
+                        break;
+                    }
+                    sent -= (DWORD)left;
+                    c.outQueue.pop_front();
+                    c.frontSent = 0;
+                }
+                c.outCv.notify_all();
+            }
+            c.wantWrite = false;
+            return true;
+        }
+
+        static void failOutputLocked(Chat& c){
+            c.outFailed = true;
+            c.outQueue.clear();
+            c.held.clear();
+            c.outBytes = 0;
+            c.frontSent = 0;
+            c.wantWrite = false;
+            c.outCv.notify_all();
+        }
+
+        static void failOutput(Chat& c){
+            std::lock_guard<std::mutex> lock(c.outMutex);
+            failOutputLocked(c);
+        }
+
+        void reactorLoop(){
+            std::vector<WSAPOLLFD> fds;
+            std::vector<std::shared_ptr<Chat>> polled;
+            std::vector<char> buf(64 * 1024);
+
+            while (!stop_){
+                int timeoutMs = 1000;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (undecided_ > 0){
+                        settleExpiredLocked();
+                        if (undecided_ > 0) timeoutMs = 50;
+                    }
+                    if (dirty_){
+                        dirty_ = false;
+                        fds.clear();
+                        polled.clear();
+                        fds.push_back({wakeSock_, POLLRDNORM, 0});
+                        fds.push_back({listenSock_, POLLRDNORM, 0});
+                        for (auto& [id, c]: chats_){
+                            if (c->state == Chat::CLOSED) continue;
+                            fds.push_back({c->sock, POLLRDNORM, 0});
+                            polled.push_back(c);
+                        }
+                    }
+                }
+                // chats with output the socket did not take also wait for room
+                for (size_t i = 2; i < fds.size(); i++){
+                    fds[i].events = POLLRDNORM | (polled[i - 2]->wantWrite ? POLLWRNORM : 0);
+                }
+
+                if (WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs) <= 0) continue;
+
+                if (fds[0].revents){
+                    while (recv(wakeSock_, buf.data(), (int)buf.size(), 0) > 0) {}
+                }
+                if (fds[1].revents & POLLRDNORM) acceptConnection();
+
+                for (size_t i = 2; i < fds.size(); i++){
+                    short revents = fds[i].revents;
+                    if (revents == 0) continue;
+                    fds[i].revents = 0;
+                    if ((revents & POLLWRNORM) && polled[i - 2]->wantWrite) flush(*polled[i - 2]);
+                    if (revents & ~POLLWRNORM) readChat(polled[i - 2], buf.data(), (int)buf.size());
+                }
+            }
+        }
+
+        void acceptConnection(){
+            sockaddr_in peerAddr{};
+            int len = sizeof(peerAddr);
+            SOCKET s = accept(listenSock_, (sockaddr*)&peerAddr, &len);
+            if (s == INVALID_SOCKET) return;
+
+            char ip[INET_ADDRSTRLEN] = {0};
+            InetNtopA(AF_INET, &peerAddr.sin_addr, ip, sizeof(ip));
+            std::string peer = std::string(ip) + ":" + std::to_string(ntohs(peerAddr.sin_port));
+
+            if (addChat(s, peer, Chat::PENDING) == 0){
+                std::string reject = "REJECT\n";
+                ::send(s, reject.c_str(), (int)reject.size(), 0);
+                closesocket(s);
+            }
+        }
+
+        // reads what is available and decodes every complete frame or line in it
+        void readChat(const std::shared_ptr<Chat>& c, char* buf, int size){
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (c->state == Chat::CLOSED) return;
+            }
+
+            int n = recv(c->sock, buf, size, 0);
+            if (n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return;
+            if (n <= 0){
+                dropChat(c);
+                return;
+            }
+            c->readBuf.append(buf, n);
+
+            uint32_t lastData = 0;
+            bool ok;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ok = decodeLocked(*c, lastData);
+            }
+            if (!ok){
+                dropChat(c);
+                return;
+            }
+            // one cumulative ack per read
+            if (lastData != 0) writeRaw(*c, encodeFrame(FRAME_ACK, lastData, ""));
+        }
+
+        // consumes complete frames (or lines, before and without framing) from
+        // readBuf. false on a protocol violation.
+        bool decodeLocked(Chat& c, uint32_t& lastData){
+            const std::string& in = c.readBuf;
+            size_t pos = 0;
+
+            while (pos < in.size()){
+                if (c.framed){
+                    if (in.size() - pos < FRAME_HEADER) break;
+                    uint32_t len, id;
+                    memcpy(&len, &in[pos], 4);
+                    memcpy(&id, &in[pos + 4], 4);
+                    len = ntohl(len);
+                    id = ntohl(id);
+                    char type = in[pos + 8];
+                    if (len > MAX_MESSAGE) return false;
+                    if (in.size() - pos < FRAME_HEADER + len) break;
+
+                    if (type == FRAME_DATA){
+                        pushInboxLocked(c, in.substr(pos + FRAME_HEADER, len));
+                        lastData = id;
+                    }
+                    else if (type == FRAME_ACK){
+                        c.ackedThrough = id;
+                    }
+                    else{
+                        return false;
+                    }
+                    pos += FRAME_HEADER + len;
+                }
+                else{
+                    size_t nl = in.find('\n', pos);
+                    if (nl == std::string::npos) break;
+                    bool crlf = nl > pos && in[nl - 1] == '\r';
+                    std::string line = in.substr(pos, nl - pos - (crlf ? 1 : 0));
+                    pos = nl + 1;
+                    if (!handleLineLocked(c, std::move(line), crlf)) return false; // may switch c to frames
+                }
+            }
+
+            c.readBuf.erase(0, pos);
+            return c.readBuf.size() <= FRAME_HEADER + MAX_MESSAGE;
+        }
+
+        // crlf: the line ended in "\r\n", which on a buddy's ACCEPT offers
+        // framing. false on a protocol violation.
+        bool handleLineLocked(Chat& c, std::string line, bool crlf){
+            if (c.state == Chat::CONNECTING){
+                // the first line on an outgoing chat is the buddy's answer
+                if (line == CHAT_ACCEPT){
+                    if (crlf){
+                        // HELLO goes out before any sender can see the chat open
+                        std::lock_guard<std::mutex> out(c.outMutex);
+                        c.framed = true;
+                        queueLocked(c, CHAT_HELLO + "\n");
+                        sendLocked(c);
+                    }
+                    c.state = Chat::OPEN;
+                    pushEventLocked(ChatEvent::ACCEPTED, c.id);
+                }
+                else{
+                    pushEventLocked(ChatEvent::REJECTED, c.id);
+                    shutdown(c.sock, SD_BOTH);
+                }
+                return true;
+            }
+
+            if (c.offered){
+                // the initiator's first line tells which kind of client it is
+                c.offered = false;
+                bool hello = (line == CHAT_HELLO);
+                if (!c.modeKnown) settleModeLocked(c, hello);
+                else if (hello) return false; // after MODE_WAIT; lines went out already
+                if (hello) return true;
+            }
+            pushInboxLocked(c, std::move(line));
+            return true;
+        }
+
+        // picks the mode of an accepted chat and sends what was held for it
+        void settleModeLocked(Chat& c, bool framed){
+            std::lock_guard<std::mutex> out(c.outMutex);
+            c.framed = framed;
+            c.modeKnown = true;
+            undecided_--;
+            uint32_t id = c.lastSentId - (uint32_t)c.held.size();
+            for (auto& text: c.held){
+                c.outBytes -= text.size();
+                queueLocked(c, encodeMessage(c, ++id, text));
+            }
+            c.held.clear();
+            sendLocked(c);
+        }
+
+        void settleExpiredLocked(){
+            auto now = std::chrono::steady_clock::now();
+            for (auto& [id, c]: chats_){
+                if (c->state == Chat::OPEN && !c->modeKnown && c->modeDeadline <= now) settleModeLocked(*c, false);
+            }
+        }
+
+        void pushInboxLocked(Chat& c, std::string msg){
+            c.inbox.push_back(std::move(msg));
+            if (c.inbox.size() == 1) pushEventLocked(ChatEvent::MESSAGE, c.id);
+        }
+
+        // the peer hung up, or closeChat shut the socket down. unread lines are
+        // kept until receiveMessage drains them.
+        void dropChat(const std::shared_ptr<Chat>& c){
+            std::lock_guard<std::mutex> lock(mutex_);
+            failOutput(*c); // wakes senders waiting for room
+            if (!c->modeKnown) undecided_--;
+            c->state = Chat::CLOSED;
+            dirty_ = true;
+            if (c->inbox.empty()) chats_.erase(c->id);
+            pushEventLocked(ChatEvent::CLOSED, c->id);
+        }
+};
@@ -12,6 +12,16 @@
 #include <atomic>
 #include <chrono>
 #include <random>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <condition_variable>
+#include <cstring>
+
+#include "chat_engine.h"
+#include "trace.h"
 
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -26,6 +36,14 @@ static const string CODE_OK = "200 OK";
 static const string CODE_INVALID = "201 INVALID";
 static const string CODE_NO_SUCH = "202 NO SUCH USER";
 static const string CODE_USER_EXISTS = "203 USER EXISTS";
+static const string CODE_QUEUED = "205 QUEUED";
+
+// confirms a FETCH reply; until it arrives the server keeps the messages
+static const string FETCH_ACK = "ACK";
+
+// wait before reopening a dropped relay session, doubled after each failure
+static const auto RELAY_RETRY_MIN = chrono::milliseconds(1000);
+static const auto RELAY_RETRY_MAX = chrono::milliseconds(30000);
 
 struct BuddyStatusRecord
 {
@@ -54,18 +72,23 @@ class IMClient {
         udpServerPort_(udpPort),
         userId_(""),
         status_(ONLINE_STATUS),
-        pendingConnection_(INVALID_SOCKET),
+        relaySock_(INVALID_SOCKET),
         shutdown_(false)
         {
             tcpMessagePort_ = getRandomPort();
             udpThread_ = thread(&IMClient::udpPrescenceLoop, this);
-            welcomeThread_ = thread(&IMClient::tcpWelcomeLoop, this);
+
+            if (chats_.start(tcpMessagePort_)) cout << "\nChat listening on port " << tcpMessagePort_;
+            else cout << "\nUnable to listen on chat port " << tcpMessagePort_;
+            chatEventThread_ = thread(&IMClient::chatEventLoop, this);
         }
 
         ~IMClient(){
             shutdown_ = true;
             if (udpThread_.joinable()) udpThread_.join();
-            if (welcomeThread_.joinable()) welcomeThread_.join();
+            if (chatEventThread_.joinable()) chatEventThread_.join();
+            chats_.stop();
+            closeRelay();
         }
 
         void run(){
@@ -86,6 +109,7 @@ class IMClient {
                 case 'M': messagBuddy(); break;
                 case 'Y': acceptIncoming(); break;
                 case 'N': rejectIncoming(); break;
+                case 'G': groupChat(); break;
                 case 'X': shutdown_ = true; break;
                 default:
                     std::cout << "Unknown command.\n";
@@ -106,13 +130,21 @@ class IMClient {
         vector<BuddyStatusRecord> buddyList_;
         mutex buddyMutex_;
 
-        SOCKET pendingConnection_;
-        mutex pendingMutex_;
+        // peer-to-peer chats; the console UI below is just one user of the engine
+        ChatEngine chats_;
+
+        // relay session with the server, opened at login and reopened by the
+        // presence loop when it drops
+        SOCKET relaySock_;
+        string relayUser_;
+        string relayGroup_; // group joined in groupChat, joined again on reopen
+        atomic<bool> relayAlive_{false};
+        mutex relayMutex_;
+        thread relayThread_;
 
         atomic<bool> shutdown_;
         thread udpThread_;
-        thread welcomeThread_;
-        thread chatRecieveThread_;
+        thread chatEventThread_;
 
         // Randomly pick a port
         int getRandomPort(){
@@ -133,6 +165,7 @@ class IMClient {
             std::cout << "M: Message buddy\n";
             std::cout << "Y: Accept incoming chat\n";
             std::cout << "N: Reject incoming chat\n";
+            std::cout << "G: Group chat (relay)\n";
             std::cout << "X: Exit\n";
             std::cout << "Enter choice: ";
         }
@@ -172,30 +205,49 @@ class IMClient {
             return true;
         }
 
+        // sends one request line to the server and reads the reply: the first
+        // line, or a whole FETCH reply with fetch. false if the server could
+        // not be reached. with --trace the request carries a new trace id and
+        // the client side stages are recorded under it.
+        bool request(const string& line, string& reply, bool fetch = false){
+            reply.clear();
+            uint64_t traceId = traceEnabled() ? traceNewId() : 0;
+            TraceScope total(traceId, "client.request");
+
+            int64_t connectStart = traceId ? traceNow() : 0;
+            SOCKET sock = connectTCP();
+            if (traceId) traceRecord(traceId, "client.connect", connectStart, traceNow());
+            if (sock == INVALID_SOCKET) return false;
+
+            int64_t sentAt = traceId ? traceNow() : 0;
+            sendLine(sock, traceId ? traceFormatPrefix(traceId) + line : line);
+            if (fetch) readFetchReply(sock, reply);
+            else if (!readLine(sock, reply)) reply.clear();
+            if (traceId) traceRecord(traceId, "client.roundtrip", sentAt, traceNow());
+
+            closesocket(sock);
+            return true;
+        }
+
         void registerUser(){
             cout << "\nEnter new user id: ";
             string id;
             getline(cin, id);
 
-            SOCKET sock = connectTCP();
-            if (sock == INVALID_SOCKET){
+            string response;
+            if (!request("REG " + id, response)){
                 cout << "\n Connection Failed";
                 return ;
             }
-
-            sendLine(sock, "REG " + id);
-
-            string response;
-            if (readLine(sock, response)) {
+            if (!response.empty()) {
                 cout << "\nServer: " << response;
             }
 
             if (response.find("200") != string::npos){
                 userId_ = id;
                 cout << "\nLogged in as: " << userId_;
+                openRelayAtLogin();
             }
-
-            closesocket(sock);
         }
 
         void loginUser() {
@@ -204,6 +256,79 @@ class IMClient {
             getline(cin, id);
             userId_ = id;
             cout << "\nLogged in as: " << userId_;
+            openRelayAtLogin();
+            fetchOfflineMessages();
+        }
+
+        // buddies who cannot reach us directly relay through the server, so the
+        // session is opened up front rather than on our first relayed message
+        void openRelayAtLogin(){
+            if (!openRelay()) cout << "\n(relay unavailable; relayed messages will wait for FETCH)";
+        }
+
+        // reads "200 OK <n>" and the n message lines after it, then confirms
+        // them with ACK so the server deletes them. a reply cut short is not
+        // confirmed, and the server keeps it for the next FETCH.
+        bool readFetchReply(SOCKET s, string& out){
+            out.clear();
+            char buf[8192];
+            size_t headerEnd = string::npos, lines = 0, expected = 0;
+            while (headerEnd == string::npos || lines < expected){
+                int n = recv(s, buf, sizeof(buf), 0);
+                if (n <= 0) return false;
+                size_t from = out.size();
+                out.append(buf, n);
+                for (size_t i = from; i < out.size(); i++){
+                    if (out[i] != '\n') continue;
+                    if (headerEnd != string::npos){
+                        lines++;
+                        continue;
+                    }
+                    headerEnd = i;
+                    string header = out.substr(0, i);
+                    if (!header.empty() && header.back() == '\r') header.pop_back();
+                    if (header.compare(0, CODE_OK.size() + 1, CODE_OK + " ") == 0)
+                        expected = strtoul(header.c_str() + CODE_OK.size() + 1, nullptr, 10);
+                }
+            }
+            if (expected > 0) sendLine(s, FETCH_ACK);
+            return true;
+        }
+
+        // prints messages that buddies left while we were offline
+        void fetchOfflineMessages(){
+            string reply;
+            if (!request("FETCH " + userId_, reply, true)) return;
+
+            istringstream iss(reply);
+            string header;
+            getline(iss, header);
+            if (header.find("200") == string::npos || header == CODE_OK + " 0") return;
+
+            cout << "\nOffline messages:";
+            string line;
+            while (getline(iss, line)){
+                size_t sp = line.find(' ');
+                if (sp == string::npos) continue;
+                cout << "\n" << line.substr(0, sp) << ": " << line.substr(sp + 1);
+            }
+        }
+
+        // stores a message on the server for a buddy who is offline
+        void leaveOfflineMessage(const string& buddy){
+            cout << "\nBuddy is offline. Leave a message (empty to cancel): ";
+            string text;
+            getline(cin, text);
+            if (text.empty()) return;
+
+            string response;
+            if (!request("SEND " + userId_ + " " + buddy + " " + text, response)){
+                cout << "\nConnection Failed";
+                return;
+            }
+            if (!response.empty()){
+                cout << "\nServer: " << response;
+            }
         }
 
         void addBuddy(){
@@ -216,18 +341,14 @@ class IMClient {
             string buddy;
             getline(cin, buddy);
 
-            SOCKET sock = connectTCP();
-            if (sock == INVALID_SOCKET){
+            string response;
+            if (!request("ADD " + userId_ + " " + buddy, response)){
                 cout << "\nConnection Failed";
                 return;
             }
-
-            sendLine(sock, "ADD " + userId_ + " " + buddy);
-            string response;
-            if (readLine(sock, response)){
+            if (!response.empty()){
                 cout << "\nServer: " << response;
             }
-            closesocket(sock);
         }
 
         void deleteBuddy(){
@@ -240,18 +361,14 @@ class IMClient {
             std::string buddy;
             std::getline(std::cin, buddy);
 
-            SOCKET sock = connectTCP();
-            if (sock == INVALID_SOCKET){
+            string response;
+            if (!request("DEL " + userId_ + " " + buddy, response)){
                 cout << "\nConnection Failed";
                 return;
             }
-
-            sendLine(sock, "DEL " + userId_ + " " + buddy);
-            string response;
-            if (readLine(sock,response)){
+            if (!response.empty()){
                 cout << "\nServer: " << response;
             }
-            closesocket(sock);
         }
 
         // extra method for status
@@ -273,12 +390,23 @@ class IMClient {
         void udpPrescenceLoop() {
             SOCKET udpSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
+            // bounded wait, so a lost page ends the poll instead of stalling the loop
+            DWORD timeoutMs = 500;
+            setsockopt(udpSock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeoutMs, sizeof(timeoutMs));
+
             sockaddr_in serverAddr{};
             serverAddr.sin_family = AF_INET;
             serverAddr.sin_port = htons(udpServerPort_);
             inet_pton(AF_INET, serverIP_.c_str(), &serverAddr.sin_addr);
 
-            char buffer[4096];
+            // presence version of the last complete poll, per logged in user
+            string versionUser;
+            uint64_t presenceVersion = 0;
+
+            // a dropped relay session (server restarted or handed off) is reopened
+            // with backoff, then FETCH collects what was queued meanwhile
+            auto relayRetryAt = chrono::steady_clock::now();
+            auto relayBackoff = RELAY_RETRY_MIN;
 
             while (!shutdown_){
                 if (!userId_.empty()){
@@ -288,18 +416,25 @@ class IMClient {
                     << " " << status_.substr(4) << " " << tcpMessagePort_;
                     
                     sendto(udpSock, setMsg.str().c_str(), (int)setMsg.str().size(), 0, (sockaddr*)&serverAddr, sizeof(serverAddr));
-                    // try get
-                    string getMsg = "GET " + userId_;
-                    sendto(udpSock, getMsg.c_str(), (int)getMsg.size(), 0, (sockaddr*)&serverAddr, sizeof(serverAddr));
-                    
-                    // response
-                    sockaddr_in from{};
-                    int fromLen = sizeof(from);
-                    int n = recvfrom(udpSock, buffer, 4095, 0, (sockaddr*)&from, &fromLen);
 
-                    if (n>0){
-                        buffer[n] = '\0';
-                        parseBuddyStatus(buffer);
+                    // try get
+                    if (versionUser != userId_){
+                        versionUser = userId_;
+                        presenceVersion = 0;
+                    }
+                    pollBuddyStatus(udpSock, serverAddr, presenceVersion);
+
+                    auto now = chrono::steady_clock::now();
+                    if (relayAlive_) relayBackoff = RELAY_RETRY_MIN;
+                    else if (now >= relayRetryAt){
+                        if (reopenRelay()){
+                            cout << "\nRelay session reopened.\n";
+                            fetchOfflineMessages();
+                        }
+                        else {
+                            relayRetryAt = now + relayBackoff;
+                            relayBackoff = min(relayBackoff * 2, RELAY_RETRY_MAX);
+                        }
                     }
                 }
                 this_thread::sleep_for(chrono::milliseconds(800));
@@ -307,12 +442,72 @@ class IMClient {
             closesocket(udpSock);
         }
 
-        void parseBuddyStatus(const string& msg){
-            vector<BuddyStatusRecord> list;
-            istringstream iss(msg);
+        // fetches the buddy list with GETP, one datagram per page. with since > 0 the
+        // server only sends buddies that changed after that version, which are merged
+        // into buddyList_. since is advanced only when every page arrived.
+        void pollBuddyStatus(SOCKET udpSock, const sockaddr_in& serverAddr, uint64_t& since){
+            char buffer[4096];
+            vector<BuddyStatusRecord> entries;
+            string mode;
+            uint64_t version = 0;
+            string cursor = "0";
+
+            while (cursor != "END"){
+                string getMsg = "GETP " + userId_ + " " + cursor + " " + to_string(since);
+                sendto(udpSock, getMsg.c_str(), (int)getMsg.size(), 0, (sockaddr*)&serverAddr, sizeof(serverAddr));
+
+                while (true){
+                    sockaddr_in from{};
+                    int fromLen = sizeof(from);
+                    int n = recvfrom(udpSock, buffer, sizeof(buffer) - 1, 0, (sockaddr*)&from, &fromLen);
+                    if (n <= 0) return;
+                    buffer[n] = '\0';
+
+                    istringstream iss(buffer);
+                    string header;
+                    getline(iss, header);
+                    istringstream hs(header);
+                    string tag, pageMode, pageCursor, next;
+                    uint64_t pageVersion = 0;
+                    hs >> tag >> pageMode >> pageVersion >> pageCursor >> next;
+
+                    // a late reply to an earlier request
+                    if (tag != "PAGE" || pageCursor != cursor) continue;
+
+                    if (cursor == "0"){
+                        mode = pageMode;
+                        version = pageVersion;
+                    }
+                    else if (pageMode != mode){
+                        return; // list changed mid-poll; retry next round
+                    }
+
+                    parseBuddyLines(iss, entries);
+                    cursor = next;
+                    break;
+                }
+            }
+
+            lock_guard<mutex> lock(buddyMutex_);
+            if (mode == "FULL"){
+                buddyList_ = entries;
+            }
+            else{
+                for (auto& e: entries){
+                    auto it = find_if(buddyList_.begin(), buddyList_.end(),
+                        [&](const BuddyStatusRecord& b){ return b.buddyId == e.buddyId; });
+                    if (it != buddyList_.end()) *it = e;
+                    else buddyList_.push_back(e);
+                }
+            }
+            since = version;
+        }
+
+        void parseBuddyLines(istream& in, vector<BuddyStatusRecord>& list){
             string line;
 
-            while (getline(iss, line)){
+            while (getline(in, line)){
+                if (line.empty()) continue;
                 istringstream ls(line);
                 BuddyStatusRecord rec;
 
@@ -323,70 +518,56 @@ class IMClient {
 
                 list.push_back(rec);
             }
-
-            lock_guard<mutex> lock(buddyMutex_);
-            buddyList_ = list;
         }
 
 
-        // display incoming chat(s)
-        void tcpWelcomeLoop(){
-            SOCKET listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-            sockaddr_in addr{};
-            addr.sin_family = AF_INET;
-            addr.sin_addr.s_addr = INADDR_ANY;
-            addr.sin_port = htons(tcpMessagePort_);
-            
-            bind(listenSock, (sockaddr*)&addr, sizeof(addr));
-            listen(listenSock, 4);
-        
-            cout << "\nChat listening on port " << tcpMessagePort_;
-            
+        // prints what happens on chats while the menu keeps running
+        void chatEventLoop(){
+            ChatEvent ev;
             while (!shutdown_){
-                sockaddr_in clientAddr{};
-                int len = sizeof(clientAddr);
-
-                SOCKET sock = accept(listenSock, (sockaddr*)&clientAddr, &len);
-                if (sock == INVALID_SOCKET) continue;
-
-                lock_guard<mutex> lock(pendingMutex_);
-                if (pendingConnection_ != INVALID_SOCKET){
-                    sendLine(sock, "REJECT");
-                    closesocket(sock);
+                if (!chats_.nextEvent(ev, 200)) continue;
+
+                switch (ev.type){
+                case ChatEvent::INCOMING:
+                    cout << "\nIncoming chat request #" << ev.chat << " from " << chats_.peerOf(ev.chat) << ". Accept? (Y/N)";
+                    break;
+                case ChatEvent::MESSAGE:{
+                    string msg;
+                    while (chats_.receiveMessage(ev.chat, msg)){
+                        cout << "\n#" << ev.chat << ": " << msg << "\n";
+                    }
+                    break;
                 }
-                else{
-                    pendingConnection_ = sock;
-                    cout << "\nIncoming chat request. Accept? (Y/N)";
+                case ChatEvent::CLOSED:
+                    cout << "\nChat #" << ev.chat << " ended.\n";
+                    break;
+                default:
+                    break; // ACCEPTED / REJECTED are handled by messagBuddy
                 }
             }
-            closesocket(listenSock);
-        }   
-    
+        }
+
         // Accept or Reject Requests
 
         void acceptIncoming(){
-            lock_guard<mutex> lock(pendingMutex_);
-            if (pendingConnection_ == INVALID_SOCKET){
+            vector<int> pending = chats_.pendingChats();
+            if (pending.empty()){
                 cout << "\nNo Pending Connection";
                 return;
             }
-            
-            sendLine(pendingConnection_, "ACCEPT");
-            startChat(pendingConnection_);
-            pendingConnection_ = INVALID_SOCKET;
+
+            int chat = pending.front();
+            if (chats_.acceptChat(chat)) startChat(chat);
         }
 
         void rejectIncoming(){
-            lock_guard<mutex> lock(pendingMutex_);
-            if (pendingConnection_ == INVALID_SOCKET){
+            vector<int> pending = chats_.pendingChats();
+            if (pending.empty()){
                 cout << "\nNo Pending Connection";
                 return;
             }
 
-            sendLine(pendingConnection_, "REJECT");
-            closesocket(pendingConnection_);
-            pendingConnection_ = INVALID_SOCKET;
+            chats_.rejectChat(pending.front());
         }
 
         // chat messages
@@ -395,15 +576,6 @@ class IMClient {
                 cout << "\nMust Login";
                 return;
             }
-            
-            // if the connection is still pending, we must ask.
-            {
-                lock_guard<mutex> lock(pendingMutex_);
-                if (pendingConnection_ != INVALID_SOCKET){
-                    cout << "\nAccept Incmoing Chat First: (Y/N)";
-                    return;
-                }
-            }
 
             cout << "\nEnter Buddy id: ";
             string buddy;
@@ -427,71 +599,208 @@ class IMClient {
             }
 
             if (!rec.isOnline()){
-                cout << "\nBuddy is offline";
+                leaveOfflineMessage(buddy);
                 return;
             }
 
-            SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-            sockaddr_in addr{};
-            addr.sin_family = AF_INET;
-            inet_pton(AF_INET, rec.ip.c_str(), &addr.sin_addr);
-            addr.sin_port = htons(rec.port);
-
-            if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0){
-                cout << "\nUnable to connect to buddy";
-                closesocket(s);
+            int chat = chats_.openChat(rec.ip, rec.port);
+            if (chat == 0){
+                cout << "\nUnable to connect to buddy, chatting through the server";
+                relayChat(buddy);
                 return;
             }
 
-            string line;
-            if (!readLine(s, line) || line == "REJECT"){
+            cout << "\nWaiting for " << buddy << " to accept...";
+            if (!chats_.waitOpen(chat, 60000)){
                 cout << "\nBuddy Rejected Chat";
-                closesocket(s);
+                chats_.closeChat(chat);
                 return;
             }
+            startChat(chat);
+        }
+
+        // sends typed lines to one chat; other chats keep receiving meanwhile
+        void startChat(int chat) {
+            std::cout << "Chat #" << chat << " started. Type 'q' to quit.\n";
+
+            while (true) {
+                std::string line;
+                if (!std::getline(std::cin, line) || line == "q") break;
+                if (line.size() > ChatEngine::MAX_MESSAGE){
+                    std::cout << "Message too long (" << line.size() << " bytes, the limit is "
+                              << ChatEngine::MAX_MESSAGE << "). Not sent.\n";
+                    continue;
+                }
+                if (!chats_.sendMessage(chat, line)) break;
+            }
+
+            chats_.closeChat(chat);
+        }
+
+        // Relay methods
+
+        // switches a server connection into a relay session for the logged in user.
+        // the session is kept for the rest of the login and reopened after a drop.
+        bool openRelay(){
+            lock_guard<mutex> lock(relayMutex_);
+            if (relayAlive_ && relayUser_ == userId_) return true;
+            return openRelayLocked();
+        }
+
+        // true only if a dropped session was opened again here; a session
+        // that is up (say, just opened by the login) is left alone
+        bool reopenRelay(){
+            lock_guard<mutex> lock(relayMutex_);
+            if (relayAlive_ && relayUser_ == userId_) return false;
+            return openRelayLocked();
+        }
+
+        bool openRelayLocked(){
+            closeRelayLocked();
+
+            SOCKET s = connectTCP();
+            if (s == INVALID_SOCKET) return false;
 
-            if (line == "ACCEPT"){
-                startChat(s);
-            }else{
-                cout << "Unexpected Response: " << line << "\n";
+            string response;
+            if (!sendLine(s, "RELAY " + userId_) || !readLine(s, response) || response != CODE_OK){
                 closesocket(s);
+                return false;
             }
+
+            if (relayUser_ != userId_) relayGroup_.clear();
+            if (!relayGroup_.empty()) sendLine(s, "JOIN " + relayGroup_);
+
+            relaySock_ = s;
+            relayUser_ = userId_;
+            relayAlive_ = true;
+            relayThread_ = thread(&IMClient::relayRecieveLoop, this, s);
+            return true;
         }
 
-        void startChat(SOCKET s) {
-            std::cout << "Chat started. Type 'q' to quit.\n";
+        void closeRelay(){
+            lock_guard<mutex> lock(relayMutex_);
+            closeRelayLocked();
+        }
 
-            // Launch receive thread
-            chatRecieveThread_ = std::thread([this, s]() {
-                char c;
-                std::string msg;
-                while (true) {
-                    if (!readLine(s, msg)) break;
-                    std::cout << "\nB: " << msg << "\n";
+        // the receive thread never takes relayMutex_, so joining it here is safe
+        void closeRelayLocked(){
+            if (relaySock_ != INVALID_SOCKET) shutdown(relaySock_, SD_BOTH);
+            if (relayThread_.joinable()) relayThread_.join();
+            if (relaySock_ != INVALID_SOCKET) closesocket(relaySock_);
+            relaySock_ = INVALID_SOCKET;
+            relayAlive_ = false;
+        }
+
+        // prints relayed messages and the server's replies to our commands
+        void relayRecieveLoop(SOCKET s){
+            string line;
+            while (readLine(s, line)){
+                istringstream iss(line);
+                string tag;
+                iss >> tag;
+
+                if (tag == "FROM"){
+                    string from, text;
+                    iss >> from;
+                    iss.get();
+                    getline(iss, text);
+                    cout << "\n" << from << ": " << text << "\n";
+                }
+                else if (tag == "GROUP"){
+                    string group, from, text;
+                    iss >> group >> from;
+                    iss.get();
+                    getline(iss, text);
+                    cout << "\n[" << group << "] " << from << ": " << text << "\n";
+                }
+                else if (line == CODE_QUEUED){
+                    cout << "\n(buddy is offline, message kept for them)\n";
+                }
+                else if (line != CODE_OK){
+                    cout << "\nServer: " << line << "\n";
                 }
-                std::cout << "Chat ended.\n";
-            });
+            }
+            relayAlive_ = false;
+            cout << "\nRelay session ended.\n";
+        }
 
-            while (true) {
-                std::string line;
-                std::getline(std::cin, line);
+        // sends one relay command; the reply shows up on the receive thread
+        bool relaySend(const string& line){
+            lock_guard<mutex> lock(relayMutex_);
+            return relayAlive_ && sendLine(relaySock_, line);
+        }
+
+        void relayChat(const string& buddy){
+            if (!openRelay()){
+                cout << "\nRelay unavailable";
+                return;
+            }
+
+            std::cout << "\nRelay chat with " << buddy << " started. Type 'q' to quit.\n";
+            while (true){
+                string line;
+                getline(cin, line);
+                if (line == "q") break;
+                if (!relaySend("MSG " + buddy + " " + line)) cout << "\n(relay reconnecting, message not sent)\n";
+            }
+        }
+
+        void groupChat(){
+            if (userId_.empty()){
+                cout << "\nMust Login";
+                return;
+            }
+
+            cout << "\nEnter group name: ";
+            string group;
+            getline(cin, group);
+            if (group.empty() || group.find(' ') != string::npos){
+                cout << "\nInvalid group name";
+                return;
+            }
+
+            if (!openRelay() || !relaySend("JOIN " + group)){
+                cout << "\nRelay unavailable";
+                return;
+            }
+            setRelayGroup(group);
+
+            std::cout << "\nJoined " << group << ". Type 'q' to leave.\n";
+            while (true){
+                string line;
+                getline(cin, line);
                 if (line == "q") break;
-                sendLine(s, line);
+                if (!relaySend("GMSG " + group + " " + line)) cout << "\n(relay reconnecting, message not sent)\n";
             }
+            setRelayGroup("");
+            relaySend("LEAVE " + group);
+        }
 
-            closesocket(s);
-            if (chatRecieveThread_.joinable()) chatRecieveThread_.join();
+        void setRelayGroup(const string& group){
+            lock_guard<mutex> lock(relayMutex_);
+            relayGroup_ = group;
         }
     };
 
 
-    int main(){
+    int main(int argc, char* argv[]){
         WSADATA wsa;
         WSAStartup(MAKEWORD(2,2), &wsa);
-        
-        IMClient client("127.0.0.1", 1234, 1235);
-        client.run();
+
+        // im_client.exe [--trace file]
+        for (int i = 1; i < argc; i++){
+            string arg = argv[i];
+            if (arg == "--trace" && i + 1 < argc && !traceStart(argv[++i], "im_client")){
+                cout << "Cannot write trace file " << argv[i] << "\n";
+                return 1;
+            }
+        }
+
+        {
+            IMClient client("127.0.0.1", 1234, 1235);
+            client.run();
+        }
+        traceFlush();
 
         WSACleanup();
         return 0;
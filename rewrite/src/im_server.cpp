@@ -3,19 +3,42 @@
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h> // REQUIRED for InetNtop, INET_ADDRSTRLEN
+#include <io.h>       // _commit
 #pragma comment(lib, "ws2_32.lib")
 #endif
 
+#include <cstdio>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory_resource>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <shared_mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_set>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "socket_handoff.h"
+#include "trace.h"
+#include "low_latency.h"
+#include "worker_pool.h"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -29,6 +52,7 @@ static const string CODE_OK = "200 OK";
 static const string CODE_INVALID = "201 INVALID";
 static const string CODE_NO_SUCH = "202 NO SUCH USER";
 static const string CODE_USER_EXISTS = "203 USER EXISTS";
+static const string CODE_QUEUED = "205 QUEUED"; // relay recipient offline, kept for FETCH
 
 // User Status Record
 struct StatusRecord
@@ -36,146 +60,1613 @@ struct StatusRecord
     string IPaddress; 
     int port = 0;
     string status;
+    uint64_t version = 0; // presence clock value at the last change
 };
 
-// IM Server
+// relay forwarding between backends (--relay-peers): how long a peer may take
+// to answer before it is skipped
+static const DWORD RELAY_PEER_TIMEOUT_MS = 2000;
 
-class IMServer
+// a FETCH client confirms it has every message with this line; the messages
+// are kept for the next FETCH if it does not arrive in time
+static const string FETCH_ACK = "ACK";
+static const DWORD FETCH_ACK_TIMEOUT_MS = 10000;
+
+// GETP pages are kept under a typical MTU so they never fragment
+static const size_t PAGE_BYTES = 1200;
+
+// how often the users dir is listed even though its time did not change, for
+// list files edited in place. the dir's time is polled every
+// USERS_POLL_INTERVAL, and a change (a new user, a replaced list) is listed
+// then.
+static const auto USERS_RESCAN_INTERVAL = chrono::seconds(5);
+static const auto USERS_POLL_INTERVAL = chrono::seconds(1);
+
+// Per-thread bump arena for request scratch (buddy lists, reply text).
+// Allocations are pointer bumps into a fixed buffer and are all dropped at once
+// when the request ends, so per-request vectors/strings never reach the heap
+// unless a request outgrows the buffer.
+class RequestArena
+{
+public:
+    RequestArena() : mono_(buf_, sizeof(buf_), pmr::new_delete_resource()) {}
+
+    pmr::memory_resource *resource() { return &mono_; }
+
+    // scopes nest (a request handler calling loadBuddyList, say). only the
+    // outermost one releases, so an inner scope never frees what the outer
+    // request still holds; inner allocations live until the request ends.
+    void enter() { depth_++; }
+    void leave()
+    {
+        if (--depth_ == 0)
+            mono_.release();
+    }
+
+    static RequestArena &local()
+    {
+        static thread_local RequestArena arena;
+        return arena;
+    }
+
+private:
+    alignas(max_align_t) char buf_[16 * 1024];
+    pmr::monotonic_buffer_resource mono_;
+    int depth_ = 0;
+};
+
+// marks a request's use of the calling thread's arena; the arena is reset when
+// the outermost scope ends
+struct ArenaScope
 {
+    RequestArena &arena = RequestArena::local();
+    ArenaScope() { arena.enter(); }
+    ~ArenaScope() { arena.leave(); }
+
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+};
+
+using ScratchList = pmr::vector<pmr::string>;
 
+// Dense integer handle for a user id. Ids are interned once at the protocol
+// boundary; presence and the buddy graph are indexed by handle behind it.
+using UserHandle = uint32_t;
+static const UserHandle NO_USER = UINT32_MAX;
+
+class InternTable
+{
 public:
-    IMServer(int tcpPort, int udpPort, const string& dataDir): tcpPort_(tcpPort), udpPort_(udpPort), dataDir_(dataDir), stop_(false){
-        fs::create_directories(fs::path(dataDir_) / "users");
+    // returns the existing handle for id, or assigns the next one
+    UserHandle intern(string_view id)
+    {
+        {
+            shared_lock<shared_mutex> lock(mutex_);
+            auto it = ids_.find(id);
+            if (it != ids_.end())
+                return it->second;
+        }
+        unique_lock<shared_mutex> lock(mutex_);
+        auto it = ids_.find(id);
+        if (it != ids_.end())
+            return it->second;
+        UserHandle h = (UserHandle)names_.size();
+        names_.emplace_back(id);
+        ids_.emplace(names_.back(), h);
+        return h;
     }
-    // run server function
-    void run()
+
+    UserHandle find(string_view id) const
     {
-        thread udpThread(&IMServer::udpLoop, this);
-        tcpAcceptLoop();
-        udpThread.join();
+        shared_lock<shared_mutex> lock(mutex_);
+        auto it = ids_.find(id);
+        return it == ids_.end() ? NO_USER : it->second;
+    }
+
+    // names_ is a deque, so the reference stays valid as the table grows
+    const string &name(UserHandle h) const
+    {
+        shared_lock<shared_mutex> lock(mutex_);
+        return names_[h];
     }
 
 private:
-    // data structure to hold port(s)/connections, and connection lifecycle methods.
-    int tcpPort_, udpPort_;
-    string dataDir_;
-    unordered_map<string, StatusRecord> userStatus_;
-    mutex statusMutex_;
+    mutable shared_mutex mutex_;
+    unordered_map<string_view, UserHandle> ids_; // keys view into names_
+    deque<string> names_;
+};
 
-    bool stop_;
+// Split-block Bloom filter of registered user ids, so lookups for users that
+// do not exist are answered without touching the disk. A key's hash picks one
+// 32 byte block and sets one bit in each of its eight words, so a probe reads
+// a single block (one cache line) and is done in a few AVX2 instructions when
+// the compiler targets it. Inserts are atomic ORs, probes plain loads; neither
+// locks. Bits are never cleared, so "no" is always right for keys inserted
+// before the probe, and "maybe" still has to be confirmed on disk.
+class UserFilter
+{
+public:
+    static const size_t BITS_PER_KEY = 16; // ~0.1% false positives at capacity
 
-    // USER CONNECTION MANAGEMENT.
-    string userFilePath(const string &userId)
+    explicit UserFilter(size_t capacity)
+        : capacity_(max<size_t>(capacity, 1024)),
+          numBlocks_((capacity_ * BITS_PER_KEY + 255) / 256),
+          blocks_(make_unique<Block[]>(numBlocks_)) {}
+
+    size_t capacity() const { return capacity_; }
+
+    void insert(string_view key)
     {
-        return (fs::path(dataDir_) / "users" / (userId + ".txt")).string();
+        uint64_t h = hash(key);
+        Block &b = blocks_[blockIndex(h)];
+        uint32_t k = (uint32_t)h;
+        for (int i = 0; i < 8; i++)
+            atomic_ref<uint32_t>(b.words[i]).fetch_or(1u << ((k * SALT[i]) >> 27), memory_order_relaxed);
     }
 
-    bool existingUser(const string &userId)
+    bool mayContain(string_view key) const
     {
-        return fs::exists(userFilePath(userId));
+        uint64_t h = hash(key);
+        const Block &b = blocks_[blockIndex(h)];
+        uint32_t k = (uint32_t)h;
+#ifdef __AVX2__
+        const __m256i salt = _mm256_loadu_si256((const __m256i *)SALT);
+        __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int)k), salt), 27);
+        __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+        __m256i block = _mm256_load_si256((const __m256i *)b.words);
+        return _mm256_testc_si256(block, mask); // every mask bit set in block
+#else
+        for (int i = 0; i < 8; i++)
+        {
+            uint32_t word = atomic_ref<uint32_t>(const_cast<uint32_t &>(b.words[i])).load(memory_order_relaxed);
+            if (!(word & (1u << ((k * SALT[i]) >> 27))))
+                return false;
+        }
+        return true;
+#endif
+    }
+
+private:
+    struct alignas(32) Block
+    {
+        uint32_t words[8] = {};
+    };
+
+    static constexpr uint32_t SALT[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                         0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+    // FNV-1a with a murmur finalizer, so both halves of the result are usable
+    static uint64_t hash(string_view key)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : key)
+        {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    size_t blockIndex(uint64_t h) const
+    {
+        return (size_t)(((h >> 32) * numBlocks_) >> 32);
+    }
+
+    size_t capacity_;
+    size_t numBlocks_;
+    unique_ptr<Block[]> blocks_;
+};
+
+// In-memory forward buddy list, cached from the user's file. mtime is the file
+// time we last loaded or wrote, so edits made by another server sharing the
+// data directory are picked up on the next access.
+struct BuddyList
+{
+    vector<UserHandle> buddies;
+    fs::file_time_type mtime{};
+    uint64_t version = 0; // presence clock value at the last membership change
+    uint64_t listedTime = 0; // file time in the users dir listing that last checked it
+    bool loaded = false;
+};
+
+// Per-recipient offline message queue. Messages are appended as "<from> <text>"
+// lines to segment files under <root>/<user>/<seq>.log; a new segment starts once
+// the current one passes SEGMENT_BYTES. Only a small index (one entry per
+// segment) is kept in memory, so queues can grow to millions of messages.
+//
+// The files are the source of truth, since servers behind the load balancer may
+// share a data directory. Each append opens the tail file in append mode, and a
+// drain first claims segments by renaming them to .drain. Claimed files are then
+// streamed to the caller without the queue's lock and deleted only once the
+// caller confirms delivery; anything appended later, by any server, lands in a
+// fresh .log and waits for the next drain. Claimed files that were never
+// confirmed (the client went away, or the server died) stay behind as .drain
+// and are delivered again by the next drain.
+class MessageQueue
+{
+public:
+    static const uint64_t SEGMENT_BYTES = 1 << 20;
+
+    explicit MessageQueue(const fs::path &root) : root_(root)
+    {
+        fs::create_directories(root_);
+        rebuildIndex();
+    }
+
+    bool enqueue(const string &userId, const string &from, const string &text)
+    {
+        UserQueue &q = queueFor(userId);
+        lock_guard<mutex> lock(q.m);
+
+        if (q.segments.empty() || q.segments.back().bytes >= SEGMENT_BYTES)
+            q.segments.push_back({q.nextSeq++, 0, 0});
+        Segment &tail = q.segments.back();
+
+        error_code ec;
+        fs::create_directories(root_ / userId, ec);
+        string line = from + " " + text + "\n";
+        ofstream ofs(segmentPath(userId, tail.seq, ".log"), ios::app | ios::binary);
+        ofs.write(line.data(), line.size());
+        ofs.flush();
+        if (!ofs)
+            return false;
+
+        tail.bytes += line.size();
+        tail.count++;
+        return true;
+    }
+
+    // delivers userId's queue: onStart(count) once, then onChunk(bytes) per
+    // segment, then onDone() to wait for the caller's confirmation. claimed
+    // segments are deleted only if every step succeeded; otherwise all of
+    // them stay queued and are delivered again (delivery is at-least-once).
+    // the queue's lock is held only while claiming, never while sending, and
+    // memory use is one segment.
+    template <typename Start, typename Chunk, typename Done>
+    bool drain(const string &userId, Start onStart, Chunk onChunk, Done onDone)
+    {
+        UserQueue &q = queueFor(userId);
+        vector<fs::path> claimed;
+        size_t total = 0;
+        {
+            lock_guard<mutex> lock(q.m);
+            claimed = claimSegments(userId, q);
+            for (auto &path : claimed)
+                total += countMessages(path, q);
+            q.segments.clear(); // every indexed segment is claimed now
+        }
+
+        bool delivered = onStart(total);
+        string buf;
+        for (size_t i = 0; delivered && i < claimed.size(); i++)
+        {
+            error_code ec;
+            auto size = fs::file_size(claimed[i], ec);
+            buf.resize(ec ? 0 : size);
+            ifstream ifs(claimed[i], ios::binary);
+            ifs.read(buf.data(), buf.size());
+            delivered = onChunk(buf);
+        }
+        // an empty reply needs no confirmation
+        delivered = delivered && (total == 0 || onDone());
+
+        lock_guard<mutex> lock(q.m);
+        for (auto &path : claimed)
+        {
+            error_code ec;
+            if (delivered)
+                fs::remove(path, ec);
+            q.delivering.erase(path.string());
+        }
+        return delivered;
+    }
+
+private:
+    struct Segment
+    {
+        uint64_t seq;
+        uint32_t count;
+        uint64_t bytes;
+    };
+
+    struct UserQueue
+    {
+        mutex m;
+        deque<Segment> segments; // unclaimed segments, oldest first
+        uint64_t nextSeq = 1;
+        unordered_set<string> delivering; // .drain files a drain here is sending
+    };
+
+    fs::path root_;
+    unordered_map<string, unique_ptr<UserQueue>> queues_;
+    mutex mapMutex_;
+    atomic<uint64_t> claimCounter_{0};
+
+    static string padded(uint64_t n, size_t width)
+    {
+        string s = to_string(n);
+        s.insert(0, width - min(width, s.size()), '0'); // sorts by name
+        return s;
+    }
+
+    // segment files are named by sequence number. anything else that ends up
+    // in a queue dir (a stray copy, an editor backup) is left alone.
+    static bool parseSeq(const string &text, uint64_t &seq)
+    {
+        const char *first = text.data(), *last = text.data() + text.size();
+        auto [end, ec] = from_chars(first, last, seq);
+        return ec == errc() && end == last && first != last;
+    }
+
+    fs::path segmentPath(const string &userId, uint64_t seq, const string &ext)
+    {
+        return root_ / userId / (padded(seq, 10) + ext);
+    }
+
+    UserQueue &queueFor(const string &userId)
+    {
+        lock_guard<mutex> lock(mapMutex_);
+        auto &q = queues_[userId];
+        if (!q)
+            q = make_unique<UserQueue>();
+        return *q;
+    }
+
+    // renames every .log segment to "<seq>.<claim>.drain" so later appends go to
+    // new files, and returns all .drain files (including ones left by a failed
+    // drain) in delivery order, except those another drain on this server is
+    // still sending. caller holds q.m.
+    vector<fs::path> claimSegments(const string &userId, UserQueue &q)
+    {
+        error_code ec;
+        string claim = padded(++claimCounter_, 20);
+        uint64_t seq;
+        for (auto &f : fs::directory_iterator(root_ / userId, ec))
+        {
+            if (f.path().extension() != ".log" || !parseSeq(f.path().stem().string(), seq))
+                continue;
+            auto target = f.path().parent_path() / (f.path().stem().string() + "." + claim + ".drain");
+            fs::rename(f.path(), target, ec);
+            q.nextSeq = max<uint64_t>(q.nextSeq, seq + 1);
+        }
+
+        vector<fs::path> claimed;
+        for (auto &f : fs::directory_iterator(root_ / userId, ec))
+        {
+            if (f.path().extension() == ".drain" && parseSeq(f.path().stem().stem().string(), seq) &&
+                q.delivering.insert(f.path().string()).second)
+                claimed.push_back(f.path());
+        }
+        sort(claimed.begin(), claimed.end());
+        return claimed;
+    }
+
+    // uses the index when it matches the file, else counts lines on disk
+    size_t countMessages(const fs::path &path, UserQueue &q)
+    {
+        error_code ec;
+        auto size = fs::file_size(path, ec);
+        uint64_t seq;
+        if (!parseSeq(path.stem().stem().string(), seq))
+            return countLines(path);
+        for (auto &seg : q.segments)
+        {
+            if (seg.seq == seq && seg.bytes == size)
+                return seg.count;
+        }
+        return countLines(path);
+    }
+
+    static size_t countLines(const fs::path &path)
+    {
+        size_t n = 0;
+        char buf[64 * 1024];
+        ifstream ifs(path, ios::binary);
+        while (ifs.read(buf, sizeof(buf)) || ifs.gcount() > 0)
+            n += count(buf, buf + ifs.gcount(), '\n');
+        return n;
+    }
+
+    // recovers the index from the .log segments left by a previous run
+    void rebuildIndex()
+    {
+        error_code ec;
+        for (auto &dir : fs::directory_iterator(root_, ec))
+        {
+            if (!dir.is_directory())
+                continue;
+
+            vector<fs::path> files;
+            uint64_t seq;
+            for (auto &f : fs::directory_iterator(dir.path(), ec))
+            {
+                if (f.path().extension() == ".log" && parseSeq(f.path().stem().string(), seq))
+                    files.push_back(f.path());
+            }
+            sort(files.begin(), files.end());
+
+            UserQueue &q = queueFor(dir.path().filename().string());
+            for (auto &f : files)
+            {
+                parseSeq(f.stem().string(), seq);
+                Segment seg{seq, (uint32_t)countLines(f), fs::file_size(f, ec)};
+                q.segments.push_back(seg);
+                q.nextSeq = seg.seq + 1;
+            }
+        }
+    }
+};
+
+// A client connection switched into relay mode with "RELAY <user>". The server
+// routes chat lines between relay sessions for clients that cannot reach each
+// other peer-to-peer. Outbound data is queued here and written by FanoutEngine;
+// the socket is closed when the last reference goes away, so a writer that is
+// still sending never sees a recycled descriptor.
+struct RelaySession
+{
+    SOCKET fd; // non-blocking
+    UserHandle user;
+
+    mutex m; // guards the fields below
+    deque<shared_ptr<const string>> outbox;
+    size_t outboxBytes = 0;
+    size_t frontSent = 0;   // bytes of outbox.front() already written
+    bool scheduled = false; // owned by the engine: ready, being written, or waiting for space
+    bool closed = false;
+
+    RelaySession(SOCKET fd, UserHandle user) : fd(fd), user(user) {}
+    ~RelaySession() { closesocket(fd); }
+};
+
+// Writes for relay sessions. Senders never touch recipient sockets: they append
+// a shared, pre-formatted frame to each recipient's outbox, so a group message
+// is formatted once no matter how many members it has. A small pool of writer
+// threads drains ready sessions, sending what is queued for one session with a
+// single vectored WSASend.
+//
+// Session sockets are non-blocking, so a writer never waits on a slow reader:
+// when the socket's send buffer is full, the unsent bytes stay in the outbox and
+// the session is parked until a poller thread sees it writable again. A reader
+// that falls MAX_OUTBOX_BYTES behind is disconnected.
+class FanoutEngine
+{
+public:
+    static const int WRITERS = 4;
+    static const size_t MAX_BATCH = 64;             // buffers per WSASend
+    static const size_t MAX_OUTBOX_BYTES = 1 << 20; // slower readers are disconnected
+    static constexpr int POLL_MS = 20;              // how soon a newly parked session is watched
+
+    FanoutEngine()
+    {
+        for (int i = 0; i < WRITERS; i++)
+            writers_.emplace_back(&FanoutEngine::writerLoop, this);
+        poller_ = thread(&FanoutEngine::pollLoop, this);
+    }
+
+    ~FanoutEngine()
+    {
+        {
+            lock_guard<mutex> lock(readyMutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : writers_)
+            t.join();
+        poller_.join();
+    }
+
+    void post(const shared_ptr<RelaySession> &target, const shared_ptr<const string> &frame)
+    {
+        postMany(&target, 1, frame);
+    }
+
+    // queues frame for every target, then wakes writers once for the whole batch
+    void postMany(const shared_ptr<RelaySession> *targets, size_t count, const shared_ptr<const string> &frame)
+    {
+        vector<shared_ptr<RelaySession>> newlyReady;
+        for (size_t i = 0; i < count; i++)
+        {
+            RelaySession &s = *targets[i];
+            lock_guard<mutex> lock(s.m);
+            if (s.closed)
+                continue;
+            if (s.outboxBytes + frame->size() > MAX_OUTBOX_BYTES)
+            {
+                closeLocked(s);
+                continue;
+            }
+            s.outbox.push_back(frame);
+            s.outboxBytes += frame->size();
+            if (!s.scheduled)
+            {
+                s.scheduled = true;
+                newlyReady.push_back(targets[i]);
+            }
+        }
+        if (newlyReady.empty())
+            return;
+
+        {
+            lock_guard<mutex> lock(readyMutex_);
+            for (auto &s : newlyReady)
+                ready_.push_back(move(s));
+        }
+        if (newlyReady.size() == 1)
+            cv_.notify_one();
+        else
+            cv_.notify_all();
+    }
+
+    // drops pending output and unblocks the session's reader
+    void close(RelaySession &s)
+    {
+        lock_guard<mutex> lock(s.m);
+        closeLocked(s);
+    }
+
+private:
+    enum SendResult
+    {
+        SENT,
+        WOULD_BLOCK,
+        FAILED
+    };
+
+    vector<thread> writers_;
+    thread poller_;
+    deque<shared_ptr<RelaySession>> ready_;
+    mutex readyMutex_;
+    condition_variable cv_;
+    bool stop_ = false;
+
+    vector<shared_ptr<RelaySession>> waiting_; // parked until writable
+    mutex waitingMutex_;
+
+    static void closeLocked(RelaySession &s)
+    {
+        if (s.closed)
+            return;
+        s.closed = true;
+        s.outbox.clear();
+        s.outboxBytes = 0;
+        s.frontSent = 0;
+        shutdown(s.fd, SD_BOTH);
+    }
+
+    // writes batch, skipping the first offset bytes, until it is all sent or
+    // the socket is full. sent is the number of bytes written.
+    static SendResult sendBatch(SOCKET fd, const vector<shared_ptr<const string>> &batch, size_t offset, size_t &sent)
+    {
+        WSABUF bufs[MAX_BATCH];
+        DWORD n = 0;
+        for (auto &frame : batch)
+        {
+            bufs[n].buf = const_cast<char *>(frame->data());
+            bufs[n].len = (u_long)frame->size();
+            n++;
+        }
+        bufs[0].buf += offset;
+        bufs[0].len -= (u_long)offset;
+
+        sent = 0;
+        WSABUF *next = bufs;
+        while (n > 0)
+        {
+            DWORD written = 0;
+            if (WSASend(fd, next, n, &written, 0, nullptr, nullptr) == SOCKET_ERROR)
+                return WSAGetLastError() == WSAEWOULDBLOCK ? WOULD_BLOCK : FAILED;
+            sent += written;
+            while (n > 0 && written >= next->len)
+            {
+                written -= next->len;
+                next++;
+                n--;
+            }
+            if (n > 0)
+            {
+                next->buf += written;
+                next->len -= written;
+            }
+        }
+        return SENT;
+    }
+
+    // drops the first sent bytes of the outbox. caller holds s.m.
+    static void consumeLocked(RelaySession &s, size_t sent)
+    {
+        while (sent > 0 && !s.outbox.empty())
+        {
+            size_t left = s.outbox.front()->size() - s.frontSent;
+            if (sent < left)
+            {
+                s.frontSent += sent;
+                return;
+            }
+            sent -= left;
+            s.outboxBytes -= s.outbox.front()->size();
+            s.outbox.pop_front();
+            s.frontSent = 0;
+        }
+    }
+
+    void writerLoop()
+    {
+        vector<shared_ptr<const string>> batch;
+        while (true)
+        {
+            shared_ptr<RelaySession> s;
+            {
+                unique_lock<mutex> lock(readyMutex_);
+                cv_.wait(lock, [&] { return stop_ || !ready_.empty(); });
+                if (stop_)
+                    return;
+                s = move(ready_.front());
+                ready_.pop_front();
+            }
+
+            // frames stay in the outbox until written, so a partial write can
+            // resume where it stopped. only this writer consumes from it.
+            batch.clear();
+            size_t offset;
+            {
+                lock_guard<mutex> lock(s->m);
+                offset = s->frontSent;
+                for (size_t i = 0; i < s->outbox.size() && batch.size() < MAX_BATCH; i++)
+                    batch.push_back(s->outbox[i]);
+            }
+
+            size_t sent = 0;
+            SendResult result = batch.empty() ? SENT : sendBatch(s->fd, batch, offset, sent);
+
+            bool again = false, park = false;
+            {
+                lock_guard<mutex> lock(s->m);
+                if (result == FAILED)
+                    closeLocked(*s);
+                if (!s->closed)
+                    consumeLocked(*s, sent);
+                if (s->closed || s->outbox.empty())
+                    s->scheduled = false;
+                else if (result == WOULD_BLOCK)
+                    park = true;
+                else
+                    again = true;
+            }
+            if (again)
+            {
+                lock_guard<mutex> lock(readyMutex_);
+                ready_.push_back(move(s));
+            }
+            else if (park)
+            {
+                lock_guard<mutex> lock(waitingMutex_);
+                waiting_.push_back(move(s));
+            }
+        }
+    }
+
+    // hands parked sessions back to the writers once their sockets have room
+    void pollLoop()
+    {
+        vector<shared_ptr<RelaySession>> watched;
+        vector<WSAPOLLFD> fds;
+        while (true)
+        {
+            {
+                lock_guard<mutex> lock(readyMutex_);
+                if (stop_)
+                    return;
+            }
+            {
+                lock_guard<mutex> lock(waitingMutex_);
+                for (auto &s : waiting_)
+                    watched.push_back(move(s));
+                waiting_.clear();
+            }
+            if (watched.empty())
+            {
+                this_thread::sleep_for(chrono::milliseconds(POLL_MS));
+                continue;
+            }
+
+            fds.resize(watched.size());
+            for (size_t i = 0; i < watched.size(); i++)
+            {
+                fds[i].fd = watched[i]->fd;
+                fds[i].events = POLLWRNORM;
+                fds[i].revents = 0;
+            }
+            if (WSAPoll(fds.data(), (ULONG)fds.size(), POLL_MS) < 0)
+                continue;
+
+            // writable, failed or closed sessions go back to a writer, which
+            // sends, reports the error or drops them
+            vector<shared_ptr<RelaySession>> wake;
+            size_t kept = 0;
+            for (size_t i = 0; i < watched.size(); i++)
+            {
+                bool closed;
+                {
+                    lock_guard<mutex> lock(watched[i]->m);
+                    closed = watched[i]->closed;
+                }
+                if (fds[i].revents != 0 || closed)
+                    wake.push_back(move(watched[i]));
+                else
+                    watched[kept++] = move(watched[i]);
+            }
+            watched.resize(kept);
+            if (wake.empty())
+                continue;
+            {
+                lock_guard<mutex> lock(readyMutex_);
+                for (auto &s : wake)
+                    ready_.push_back(move(s));
+            }
+            cv_.notify_all();
+        }
+    }
+};
+
+// buffered line reader for long-lived connections: one recv per chunk rather
+// than per byte. works on non-blocking sockets too, waiting in WSAPoll when
+// no data is queued.
+class LineReader
+{
+public:
+    static const size_t MAX_LINE = 64 * 1024;
+
+    explicit LineReader(SOCKET fd) : fd_(fd) {}
+
+    bool readLine(string &out)
+    {
+        out.clear();
+        while (true)
+        {
+            while (pos_ < len_)
+            {
+                char c = buf_[pos_++];
+                if (c == '\n')
+                    return true;
+                if (c != '\r')
+                    out.push_back(c);
+            }
+            if (out.size() > MAX_LINE)
+                return false;
+            int n = recv(fd_, buf_, sizeof(buf_), 0);
+            if (n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+            {
+                WSAPOLLFD pfd{};
+                pfd.fd = fd_;
+                pfd.events = POLLRDNORM;
+                if (WSAPoll(&pfd, 1, -1) < 0)
+                    return false;
+                continue;
+            }
+            if (n <= 0)
+                return false;
+            pos_ = 0;
+            len_ = n;
+        }
+    }
+
+private:
+    SOCKET fd_;
+    char buf_[4096];
+    size_t pos_ = 0, len_ = 0;
+};
+
+// IM Server
+
+class IMServer
+{
+
+public:
+    IMServer(int tcpPort, int udpPort, const string& dataDir, int handoffPort = 0, const LowLatencyConfig& lowLatency = {}, const vector<pair<string, int>>& relayPeers = {}): tcpPort_(tcpPort), udpPort_(udpPort), handoffPort_(handoffPort), dataDir_(dataDir), lowLatency_(lowLatency), relayPeers_(relayPeers), offline_(fs::path(dataDir) / "queue"), stop_(false){
+        fs::create_directories(fs::path(dataDir_) / "users");
+        usersDir_ = (fs::path(dataDir_) / "users" / "").string();
+    }
+    // run server function. with takeover, the listening sockets and the presence
+    // table come from the server process currently running on handoffPort.
+    // returns once this server has handed off to a replacement and drained.
+    bool run(bool takeover = false)
+    {
+        // the reverse index has to cover every list before queries are served
+        rescanUsers();
+        if (takeover ? !takeOver() : !openSockets())
+            return false;
+        if (handoffPort_ > 0)
+            thread(&IMServer::handoffLoop, this).detach();
+        thread(&IMServer::rescanLoop, this).detach();
+
+        thread udpThread(&IMServer::udpLoop, this);
+        tcpAcceptLoop();
+        udpThread.join();
+
+        cout << "\n[Server] Handed off, waiting for " << activeClients_.load() << " request(s) to finish\n";
+        // the presence snapshot is still being sent once the loops have stopped
+        while (activeClients_ > 0 || !snapshotSent_)
+            this_thread::sleep_for(chrono::milliseconds(100));
+        return true;
+    }
+
+private:
+    // data structure to hold port(s)/connections, and connection lifecycle methods.
+    int tcpPort_, udpPort_, handoffPort_;
+    SOCKET tcpSock_ = INVALID_SOCKET;
+    SOCKET udpSock_ = INVALID_SOCKET;
+    string dataDir_;
+    string usersDir_; // with a trailing separator
+    LowLatencyConfig lowLatency_;
+    // the other backends behind the load balancer. a relay message for a user
+    // without a session here is offered to each of them before it is queued.
+    vector<pair<string, int>> relayPeers_;
+    InternTable users_;
+
+    // registered ids, filled by rescanUsers and registerUser. replaced by a
+    // bigger one when the user count outgrows it; replaced filters are kept
+    // (filters_, current one last) since probes read them without a lock.
+    atomic<UserFilter *> userFilter_{nullptr};
+    vector<unique_ptr<UserFilter>> filters_;
+    mutex filterMutex_; // held by inserts and by rescanUsers
+    MessageQueue offline_;
+
+    // presence indexed by UserHandle; an empty status means never seen
+    vector<StatusRecord> userStatus_;
+    mutex statusMutex_;
+
+    // forward buddy lists indexed by UserHandle. graphMutex_ guards the cached
+    // lists and is never held across file I/O; a list's file is read and
+    // written under its listLock instead, so a GET never waits on another
+    // user's fsync. buddyLists_'s size and each list's buddies only change
+    // with indexMutex_ held as well, so setOnline can read them under
+    // indexMutex_ alone.
+    // lock order: listLock, then graphMutex_.
+    vector<BuddyList> buddyLists_;
+    mutex graphMutex_;
+    static const size_t LIST_LOCK_STRIPES = 256;
+    array<mutex, LIST_LOCK_STRIPES> listLocks_;
+
+    // reverse index: watchers_[u] holds every user whose list contains u. built
+    // from all lists at startup (rescanUsers) and kept in step with every change
+    // to a forward list. onlineWatchers_[u] counts the watchers that are online,
+    // per online_, which mirrors userStatus_.
+    // lock order: graphMutex_ or statusMutex_, then indexMutex_. no I/O under it.
+    vector<unordered_set<UserHandle>> watchers_;
+    vector<uint32_t> onlineWatchers_;
+    vector<bool> online_;
+    mutex indexMutex_;
+
+    // bumped on every presence or buddy list change; GETP deltas are relative to it
+    atomic<uint64_t> presenceClock_{0};
+
+    // relay mode: live sessions by user, and group chat membership
+    unordered_map<UserHandle, shared_ptr<RelaySession>> relaySessions_;
+    unordered_map<string, vector<UserHandle>> groups_;
+    mutex relayMutex_;
+    FanoutEngine fanout_;
+
+    atomic<bool> stop_;
+    atomic<bool> udpStopped_{false};
+    atomic<bool> snapshotSent_{false}; // handoffLoop is done with the replacement
+    atomic<int> activeClients_{0}; // TCP requests being handled
+    // threads serving TCP connections, reused from one connection to the next.
+    // never destroyed, since idle workers may still be waiting on it at exit.
+    WorkerPool &tcpWorkers_ = *new WorkerPool();
+
+    // USER CONNECTION MANAGEMENT.
+    string userFilePath(const string &userId)
+    {
+        return usersDir_ + userId + ".txt";
+    }
+
+    bool userFileExists(const string &userId)
+    {
+        return fs::exists(userFilePath(userId));
+    }
+
+    // unknown ids are rejected by the filter without touching the disk. the
+    // filter holds users registered here, users announced by relay peers (see
+    // announceUsers) and whatever rescanLoop found in the users dir.
+    bool existingUser(const string &userId)
+    {
+        UserFilter *filter = userFilter_.load(memory_order_acquire);
+        if (filter && !filter->mayContain(userId))
+            return false;
+        return userFileExists(userId);
+    }
+
+    // adds users registered by a peer sharing the data dir to the filter
+    void addPeerUsers(const vector<string> &ids)
+    {
+        lock_guard<mutex> lock(filterMutex_);
+        UserFilter *filter = userFilter_.load(memory_order_relaxed);
+        for (auto &id : ids)
+        {
+            if (filter && userFileExists(id))
+                filter->insert(id);
+        }
+    }
+
+    // tells the relay peers about users registered here, before the client
+    // sees 200, so a peer sharing the data dir never answers 202 for them.
+    // a peer that is down rescans the dir when it comes back.
+    void announceUsers(const vector<string> &ids)
+    {
+        if (ids.empty() || relayPeers_.empty())
+            return;
+        string request = "PEERREG";
+        for (auto &id : ids)
+            request += " " + id;
+        string reply;
+        for (auto &peer : relayPeers_)
+            peerRequest(peer, request, reply);
+    }
+
+    bool registerUser(const string &userId)
+    {
+        TraceScope span("server.createUserFile");
+        if (userFileExists(userId))
+        {
+            return false;
+        }
+        ofstream ofs(userFilePath(userId));
+        if (!ofs)
+            return false;
+        lock_guard<mutex> lock(filterMutex_);
+        userFilter_.load(memory_order_relaxed)->insert(userId);
+        return true;
+    }
+
+    // results live in the caller's request arena
+    ScratchList readBuddyList(const string &userId, pmr::memory_resource *mr)
+    {
+        ScratchList results(mr);
+        ifstream ifs(userFilePath(userId));
+        pmr::string line(mr);
+        while (getline(ifs, line))
+        {
+            if (!line.empty())
+            {
+                results.push_back(line);
+            }
+        }
+        return results;
+    }
+
+    mutex &listLock(UserHandle user)
+    {
+        return listLocks_[user % LIST_LOCK_STRIPES];
+    }
+
+    // caller holds graphMutex_
+    BuddyList &cachedList(UserHandle user)
+    {
+        if (buddyLists_.size() <= user)
+        {
+            lock_guard<mutex> lock(indexMutex_);
+            buddyLists_.resize(user + 1);
+        }
+        return buddyLists_[user];
+    }
+
+    // refreshes the cached list for user from disk if the file changed.
+    // returns false if the user's file does not exist. caller holds the
+    // user's listLock; graphMutex_ is only taken around the cache update.
+    bool loadBuddyList(UserHandle user)
+    {
+        const string &userId = users_.name(user);
+        error_code ec;
+        auto mtime = fs::last_write_time(userFilePath(userId), ec);
+        if (ec)
+            return false;
+        {
+            lock_guard<mutex> lock(graphMutex_);
+            BuddyList &list = cachedList(user);
+            if (list.loaded && list.mtime == mtime)
+                return true;
+        }
+
+        TraceScope span("server.readBuddyFile");
+        ArenaScope scope;
+        auto names = readBuddyList(userId, scope.arena.resource());
+        vector<UserHandle> next;
+        next.reserve(names.size());
+        for (auto &b : names)
+            next.push_back(users_.intern(b));
+
+        lock_guard<mutex> lock(graphMutex_);
+        setForwardList(user, move(next));
+        BuddyList &list = buddyLists_[user];
+        list.mtime = mtime;
+        list.version = ++presenceClock_;
+        list.loaded = true;
+        return true;
+    }
+
+    // copies the user's buddies into out; false if the user does not exist
+    bool getBuddies(UserHandle user, pmr::vector<UserHandle> &out, uint64_t &listVersion)
+    {
+        // an unchanged file, the common case, only needs graphMutex_
+        error_code ec;
+        auto mtime = fs::last_write_time(userFilePath(users_.name(user)), ec);
+        if (ec)
+            return false;
+        unique_lock<mutex> lock(graphMutex_);
+        if (!cachedList(user).loaded || buddyLists_[user].mtime != mtime)
+        {
+            lock.unlock();
+            lock_guard<mutex> fileLock(listLock(user));
+            if (!loadBuddyList(user))
+                return false;
+            lock.lock();
+        }
+        auto &buddies = buddyLists_[user].buddies;
+        out.assign(buddies.begin(), buddies.end());
+        listVersion = buddyLists_[user].version;
+        return true;
+    }
+
+    // caller holds graphMutex_
+    bool editBuddies(UserHandle user, bool isAdd, UserHandle buddy)
+    {
+        lock_guard<mutex> lock(indexMutex_);
+        vector<UserHandle> &buddies = buddyLists_[user].buddies;
+        if (isAdd)
+        {
+            if (find(buddies.begin(), buddies.end(), buddy) != buddies.end())
+                return false;
+            buddies.push_back(buddy);
+            addWatcher(buddy, user);
+            return true;
+        }
+        auto it = remove(buddies.begin(), buddies.end(), buddy);
+        bool changed = (it != buddies.end());
+        buddies.erase(it, buddies.end());
+        if (changed)
+            removeWatcher(buddy, user);
+        return changed;
+    }
+
+    // Reverse index methods. all of them expect indexMutex_ to be held.
+
+    void growGraph(UserHandle user)
+    {
+        if (watchers_.size() <= user)
+        {
+            watchers_.resize(user + 1);
+            onlineWatchers_.resize(user + 1, 0);
+            online_.resize(user + 1, false);
+        }
+    }
+
+    void addWatcher(UserHandle target, UserHandle watcher)
+    {
+        growGraph(max(target, watcher));
+        if (watchers_[target].insert(watcher).second && online_[watcher])
+            onlineWatchers_[target]++;
+    }
+
+    void removeWatcher(UserHandle target, UserHandle watcher)
+    {
+        growGraph(max(target, watcher));
+        if (watchers_[target].erase(watcher) && online_[watcher])
+            onlineWatchers_[target]--;
+    }
+
+    // replaces user's cached list, updating the reverse index with the
+    // difference. caller holds graphMutex_ and has sized buddyLists_.
+    void setForwardList(UserHandle user, vector<UserHandle> next)
+    {
+        // a hand-edited file may repeat a name; keep the first one
+        unordered_set<UserHandle> seen;
+        next.erase(remove_if(next.begin(), next.end(), [&](UserHandle h) { return !seen.insert(h).second; }), next.end());
+
+        vector<UserHandle> &cur = buddyLists_[user].buddies;
+        vector<UserHandle> before(cur), after(next);
+        sort(before.begin(), before.end());
+        sort(after.begin(), after.end());
+
+        vector<UserHandle> removed, added;
+        set_difference(before.begin(), before.end(), after.begin(), after.end(), back_inserter(removed));
+        set_difference(after.begin(), after.end(), before.begin(), before.end(), back_inserter(added));
+
+        lock_guard<mutex> lock(indexMutex_);
+        for (auto b : removed)
+            removeWatcher(b, user);
+        for (auto b : added)
+            addWatcher(b, user);
+        cur = move(next);
+    }
+
+    // a user going on or offline changes the online watcher count of everyone
+    // on their list. uses the cached list; a later reload corrects the counts
+    // through setForwardList.
+    void setOnline(UserHandle user, bool online)
+    {
+        growGraph(user);
+        if (online_[user] == online)
+            return;
+        online_[user] = online;
+        if (user >= buddyLists_.size())
+            return;
+        for (auto b : buddyLists_[user].buddies)
+        {
+            growGraph(b);
+            if (online)
+                onlineWatchers_[b]++;
+            else
+                onlineWatchers_[b]--;
+        }
+    }
+
+    // a users dir entry: the id and the file's last write time (FILETIME
+    // ticks) as the listing reports it
+    struct UserFileEntry
+    {
+        string id;
+        uint64_t writeTime;
+    };
+
+    // FindFirstFile reports each file's last write time along with its name,
+    // so listing the dir opens and stats no user file
+    vector<UserFileEntry> listUsersDir()
+    {
+        vector<UserFileEntry> entries;
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA((usersDir_ + "*.txt").c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE)
+            return entries;
+        do
+        {
+            // "*.txt" also matches longer extensions through their short names
+            string name = data.cFileName;
+            if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || name.size() <= 4 ||
+                name.compare(name.size() - 4, 4, ".txt") != 0)
+                continue;
+            uint64_t writeTime = (uint64_t)data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime;
+            entries.push_back({name.substr(0, name.size() - 4), writeTime});
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+        return entries;
+    }
+
+    // lists the users dir and adds every id to the user filter, growing it first
+    // if the users no longer fit. then every list whose file time in the
+    // listing differs from the last listing's is loaded again, which picks up
+    // new users and edits made by other servers sharing the directory. lists
+    // whose files did not change are not touched, so a pass over an unchanged
+    // dir costs one listing however many users there are.
+    void rescanUsers()
+    {
+        vector<UserFileEntry> entries;
+        {
+            // registerUser inserts under the same lock, so a user created while
+            // the dir is listed cannot be missed by a filter replacing this one
+            lock_guard<mutex> lock(filterMutex_);
+            entries = listUsersDir();
+
+            UserFilter *filter = userFilter_.load(memory_order_relaxed);
+            if (!filter || entries.size() > filter->capacity())
+            {
+                auto next = make_unique<UserFilter>(entries.size() * 2);
+                for (auto &e : entries)
+                    next->insert(e.id);
+                userFilter_.store(next.get(), memory_order_release);
+                filters_.push_back(move(next));
+            }
+            else
+            {
+                for (auto &e : entries)
+                    filter->insert(e.id);
+            }
+        }
+
+        vector<UserHandle> users;
+        users.reserve(entries.size());
+        for (auto &e : entries)
+            users.push_back(users_.intern(e.id));
+
+        vector<size_t> changed;
+        {
+            lock_guard<mutex> lock(graphMutex_);
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                BuddyList &list = cachedList(users[i]);
+                if (!list.loaded || list.listedTime != entries[i].writeTime)
+                    changed.push_back(i);
+            }
+        }
+
+        for (size_t i : changed)
+        {
+            // a list rewritten since the listing is read in its newer form and
+            // looked at once more on the next pass
+            lock_guard<mutex> fileLock(listLock(users[i]));
+            if (!loadBuddyList(users[i]))
+                continue;
+            lock_guard<mutex> lock(graphMutex_);
+            buddyLists_[users[i]].listedTime = entries[i].writeTime;
+        }
+    }
+
+    fs::file_time_type usersDirTime()
+    {
+        error_code ec;
+        return fs::last_write_time(usersDir_, ec);
+    }
+
+    // rescans every USERS_RESCAN_INTERVAL, and as soon as the users dir
+    // changed since the last listing (a user registered, a list rewritten).
+    // files edited in place leave the dir's time alone and wait for the former.
+    void rescanLoop()
+    {
+        auto lastPass = chrono::steady_clock::now();
+        fs::file_time_type listed{};
+        while (!stop_)
+        {
+            this_thread::sleep_for(USERS_POLL_INTERVAL);
+            auto now = chrono::steady_clock::now();
+            // read before listing, so a user added meanwhile changes it again.
+            // a time this recent may also be that of a user added right after
+            // the listing, so the dir is listed again on the next poll.
+            auto dirTime = usersDirTime();
+            if (dirTime == listed && now - lastPass < USERS_RESCAN_INTERVAL)
+                continue;
+            lastPass = now;
+            rescanUsers();
+            bool settled = fs::file_time_type::clock::now() - dirTime >= USERS_POLL_INTERVAL;
+            listed = settled ? dirTime : fs::file_time_type{};
+        }
+    }
+
+    // users that have target on their list
+    void getWatchers(UserHandle target, vector<UserHandle> &out)
+    {
+        lock_guard<mutex> lock(indexMutex_);
+        if (target < watchers_.size())
+            out.assign(watchers_[target].begin(), watchers_[target].end());
+    }
+
+    bool isMutual(UserHandle a, UserHandle b)
+    {
+        lock_guard<mutex> lock(indexMutex_);
+        growGraph(max(a, b));
+        return watchers_[a].count(b) && watchers_[b].count(a);
+    }
+
+    uint32_t onlineWatcherCount(UserHandle target)
+    {
+        lock_guard<mutex> lock(indexMutex_);
+        return target < onlineWatchers_.size() ? onlineWatchers_[target] : 0;
+    }
+
+    // writes names to the user's file. the list goes to a temp file that is
+    // forced to disk and then renamed over the old one, so readers never see a
+    // half-written list and a crash leaves either the old or the new list. the
+    // temp name carries the pid, since servers sharing the data directory may
+    // rewrite the same list at once; within a process the listLock serializes.
+    // no lock is needed otherwise. mtime is set to the new file's time.
+    bool writeBuddyFile(const string &userId, const vector<string> &names, fs::file_time_type &mtime)
+    {
+        TraceScope span("server.writeBuddyFile");
+        auto path = userFilePath(userId);
+        auto tmpPath = path + "." + to_string(GetCurrentProcessId()) + ".tmp";
+        error_code ec;
+
+        FILE *f = fopen(tmpPath.c_str(), "wb");
+        if (!f)
+            return false;
+        bool written = true;
+        for (auto &name : names)
+            written = written && fwrite(name.data(), 1, name.size(), f) == name.size() && fputc('\n', f) != EOF;
+        written = written && fflush(f) == 0 && _commit(_fileno(f)) == 0;
+        if (fclose(f) != 0 || !written)
+        {
+            fs::remove(tmpPath, ec);
+            return false;
+        }
+
+        fs::rename(tmpPath, path, ec);
+        if (ec)
+        {
+            fs::remove(tmpPath, ec);
+            return false;
+        }
+        mtime = fs::last_write_time(path, ec);
+        return true;
+    }
+
+    // writes the user's cached list to their file. caller holds the user's
+    // listLock but not graphMutex_, which is only taken to copy the list out
+    // and to record the result.
+    bool saveBuddyList(UserHandle user)
+    {
+        vector<string> names;
+        {
+            lock_guard<mutex> lock(graphMutex_);
+            for (auto b : buddyLists_[user].buddies)
+                names.push_back(users_.name(b));
+        }
+        fs::file_time_type mtime;
+        bool ok = writeBuddyFile(users_.name(user), names, mtime);
+
+        lock_guard<mutex> lock(graphMutex_);
+        BuddyList &list = buddyLists_[user];
+        if (!ok)
+        {
+            // the file still holds the old list; drop the cache so it is
+            // reloaded (which also reverts the reverse index)
+            list.loaded = false;
+            return false;
+        }
+        list.mtime = mtime;
+        list.version = ++presenceClock_;
+        return true;
+    }
+
+    bool updateBuddyList(bool isAdd, UserHandle user, UserHandle buddy)
+    {
+        lock_guard<mutex> fileLock(listLock(user));
+        if (!loadBuddyList(user))
+            return false;
+        {
+            lock_guard<mutex> lock(graphMutex_);
+            if (!editBuddies(user, isAdd, buddy))
+                return true;
+        }
+        return saveBuddyList(user);
+    }
+
+    // MADD/MDEL: applies every valid item to the user's list at once with a
+    // single file write. codes[i] is set to the reply code for ids[i].
+    bool updateBuddyListBulk(bool isAdd, UserHandle user, const string &userId,
+                             const vector<string> &ids, vector<const string *> &codes)
+    {
+        codes.assign(ids.size(), &CODE_OK);
+        vector<UserHandle> handles(ids.size(), NO_USER);
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            if (ids[i] == userId)
+                codes[i] = &CODE_INVALID;
+            else if (!existingUser(ids[i]))
+                codes[i] = &CODE_NO_SUCH;
+            else
+                handles[i] = users_.intern(ids[i]);
+        }
+
+        lock_guard<mutex> fileLock(listLock(user));
+        if (!loadBuddyList(user))
+            return false;
+        bool changed = false;
+        {
+            lock_guard<mutex> lock(graphMutex_);
+            for (auto h : handles)
+            {
+                if (h != NO_USER)
+                    changed |= editBuddies(user, isAdd, h);
+            }
+        }
+        return !changed || saveBuddyList(user);
+    }
+
+    // clients re-SET every poll, so the version only moves on a real change
+    void updateUserStatus(UserHandle user, const StatusRecord &rec)
+    {
+        lock_guard<mutex> lock(statusMutex_);
+        if (userStatus_.size() <= user)
+            userStatus_.resize(user + 1);
+        StatusRecord &cur = userStatus_[user];
+        if (cur.status == rec.status && cur.IPaddress == rec.IPaddress && cur.port == rec.port)
+            return;
+        cur = rec;
+        cur.version = ++presenceClock_;
+
+        // lock order: statusMutex_, then indexMutex_. a list file being read
+        // or written does not hold this up.
+        lock_guard<mutex> indexLock(indexMutex_);
+        setOnline(user, rec.status != OFFLINE_STATUS);
+    }
+
+    // auto lets the compiler deduce the type of a variable.
+    // do not use it when types are NEEDED for readability / context, but rather for verbose types to be shortened.
+    bool getUserStatus(UserHandle user, StatusRecord &out)
+    {
+        lock_guard<mutex> lock(statusMutex_);
+        if (user >= userStatus_.size() || userStatus_[user].status.empty())
+            return false;
+        out = userStatus_[user];
+        return true;
+    }
+
+    // returns the handle for userId, or NO_USER if it is neither interned nor
+    // on disk. ids are interned when they are registered, found by a rescan or
+    // named in a loaded buddy file, never for a request about an unknown id, so
+    // GET and SET spam cannot grow the tables. an interned id need not be
+    // registered, though: buddy files may name users who never were.
+    UserHandle lookupUser(const string &userId)
+    {
+        UserHandle user = users_.find(userId);
+        if (user != NO_USER)
+            return user;
+        if (!existingUser(userId))
+            return NO_USER;
+        return users_.intern(userId);
+    }
+
+    // like lookupUser, but NO_USER for every id without a user file, for the
+    // commands that must answer 202 for ids known only from buddy files
+    UserHandle lookupRegisteredUser(const string &userId)
+    {
+        return existingUser(userId) ? users_.intern(userId) : NO_USER;
+    }
+
+    // one "<id> <status> <ip> <port>" line as sent in GET/GETP replies
+    void appendBuddyEntry(pmr::string &out, UserHandle buddy, const StatusRecord *rec)
+    {
+        out += users_.name(buddy);
+        out += ' ';
+        if (rec)
+        {
+            out += rec->status;
+            out += ' ';
+            out += rec->IPaddress;
+            out += ' ';
+            out += to_string(rec->port);
+        }
+        else
+        {
+            out += OFFLINE_STATUS;
+            out += " unknown unknown";
+        }
+        out += '\n';
+    }
+
+    // TCP methods
+
+    bool openSockets()
+    {
+        tcpSock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // create TCP socket
+
+        // map to local address
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(tcpPort_);
+
+        // bind & listen w/ socket
+        bind(tcpSock_, (sockaddr *)&addr, sizeof(addr));
+        listen(tcpSock_, 16);
+
+        cout << "\nTCP listening on " << tcpPort_;
+
+        udpSock_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); // create UDP socket
+
+        addr.sin_port = htons(udpPort_);
+        bind(udpSock_, (sockaddr *)&addr, sizeof(addr));
+        return true;
     }
 
-    bool registerUser(const string &userId)
+    // hot upgrade, new process side: receive the TCP and UDP sockets, then the
+    // presence table, from the running server
+    bool takeOver()
     {
-        if (existingUser(userId))
+        SOCKET ctl = handoffConnect(handoffPort_);
+        if (ctl == INVALID_SOCKET || !handoffSendRequest(ctl))
         {
+            cout << "\n[Server] Takeover failed: no server on handoff port " << handoffPort_;
+            if (ctl != INVALID_SOCKET)
+                closesocket(ctl);
             return false;
         }
-        ofstream ofs(userFilePath(userId));
-        return (bool)ofs;
-    }
+        tcpSock_ = handoffRecvSocket(ctl);
+        udpSock_ = handoffRecvSocket(ctl);
 
-    vector<string> readBuddyList(const string &userId)
-    {
-        vector<string> results;
-        ifstream ifs(userFilePath(userId));
+        size_t count = 0, skipped = 0;
+        bool complete = false;
         string line;
-        while (getline(ifs, line))
+        HandoffLineReader reader(ctl);
+        while (reader.next(line))
         {
-            if (!line.empty())
+            if (line == HANDOFF_END)
             {
-                results.push_back(line);
+                complete = true;
+                break;
+            }
+            istringstream ls(line);
+            string userId, statusCode, statusMsg;
+            StatusRecord rec;
+            if (!(ls >> userId >> statusCode >> statusMsg >> rec.IPaddress >> rec.port))
+            {
+                skipped++;
+                continue;
             }
+            rec.status = statusCode + " " + statusMsg;
+            updateUserStatus(users_.intern(userId), rec);
+            count++;
         }
-        return results;
+        closesocket(ctl);
+
+        if (tcpSock_ == INVALID_SOCKET || udpSock_ == INVALID_SOCKET)
+        {
+            cout << "\n[Server] Takeover failed: sockets not received";
+            return false;
+        }
+        cout << "\n[Server] Took over TCP " << tcpPort_ << " / UDP " << udpPort_
+             << " with " << count << " presence record(s)";
+        // the sockets are already ours and the old process has stopped serving,
+        // so a bad snapshot is reported rather than aborting the takeover
+        if (!complete)
+            cout << "\n[Server] WARNING: presence snapshot truncated, the previous server hung up after "
+                 << count << " record(s). Users missing from it show offline until their next SET.";
+        if (skipped > 0)
+            cout << "\n[Server] WARNING: " << skipped << " malformed presence record(s) skipped";
+        return true;
     }
 
-    bool updateBuddyList(bool isAdd, const string &userId, const string &buddyId)
+    // hot upgrade, old process side: waits for a replacement, passes it both
+    // sockets, stops the UDP loop so no SET is lost, then sends the presence table
+    void handoffLoop()
     {
-        auto path = userFilePath(userId);
-        auto buddies = readBuddyList(userId);
-        bool changed = false;
+        SOCKET ctlListen = handoffListen(handoffPort_);
+        if (ctlListen == INVALID_SOCKET)
+        {
+            cout << "\n[Server] Cannot listen for handoff on port " << handoffPort_;
+            return;
+        }
 
-        if (isAdd)
+        while (true)
         {
-            if (find(buddies.begin(), buddies.end(), buddyId) == buddies.end())
+            SOCKET ctl = accept(ctlListen, nullptr, nullptr);
+            if (ctl == INVALID_SOCKET)
+                continue;
+
+            DWORD pid;
+            if (!handoffReadRequest(ctl, pid) || !handoffSendSocket(ctl, tcpSock_, pid) ||
+                !handoffSendSocket(ctl, udpSock_, pid))
             {
-                buddies.push_back(buddyId);
-                changed = true;
+                cout << "\n[Server] Handoff attempt failed";
+                closesocket(ctl);
+                continue;
             }
-        }
-        else
-        {
-            vector<string> filtered;
-            for (auto &b : buddies)
+            closesocket(ctlListen);
+
+            // the replacement's duplicates keep both sockets open; closing ours
+            // unblocks accept/recvfrom so the loops see stop_
+            stop_ = true;
+            closesocket(tcpSock_);
+            closesocket(udpSock_);
+            closeRelaySessions(); // relay clients reopen their session on the replacement
+            while (!udpStopped_)
+                this_thread::sleep_for(chrono::milliseconds(10));
+
+            string snapshot;
             {
-                if (b != buddyId)
-                {
-                    filtered.push_back(b);
-                }
-                else
+                lock_guard<mutex> lock(statusMutex_);
+                for (UserHandle u = 0; u < userStatus_.size(); u++)
                 {
-                    changed = true;
+                    const StatusRecord &rec = userStatus_[u];
+                    if (rec.status.empty())
+                        continue;
+                    snapshot += users_.name(u) + " " + rec.status + " " + rec.IPaddress + " " + to_string(rec.port) + "\n";
                 }
             }
-            buddies = filtered;
+            snapshot += HANDOFF_END + "\n";
+            if (!handoffSendAll(ctl, snapshot.c_str(), (int)snapshot.size()))
+                cout << "\n[Server] WARNING: replacement hung up during the presence snapshot";
+            closesocket(ctl);
+            snapshotSent_ = true;
+            return;
         }
-
-        if (!changed)
-            return true;
-
-        ofstream ofs(path, ios::trunc);
-        for (auto &b : buddies)
-            ofs << b << "\n";
-        return true;
-    }
-
-    void updateUserStatus(const string &userId, const StatusRecord &rec)
-    {
-        lock_guard<mutex> lock(statusMutex_);
-        userStatus_[userId] = rec;
-    }
-
-    // auto lets the compiler deduce the type of a variable.
-    // do not use it when types are NEEDED for readability / context, but rather for verbose types to be shortened.
-    bool getUserStatus(const string &userId, StatusRecord &out)
-    {
-        lock_guard<mutex> lock(statusMutex_);
-        auto it = userStatus_.find(userId);
-        if (it == userStatus_.end())
-            return false;
-        out = it->second;
-        return true;
     }
 
-    // TCP methods
-
     void tcpAcceptLoop()
     {
-        SOCKET serverFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // create TCP socket
-
-        // map to local address
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(tcpPort_);
-
-        // bind & listen w/ socket
-        bind(serverFd, (sockaddr *)&addr, sizeof(addr));
-        listen(serverFd, 16);
-
-        cout << "\nTCP listening on " << tcpPort_;
-
         // tcp connect loop while server is up.
 
         while (!stop_)
@@ -183,16 +1674,17 @@ private:
             // to accept incoming clients
             sockaddr_in clientAddr{};
             int len = sizeof(clientAddr);
-            SOCKET ClientFd = accept(serverFd, (sockaddr *)&clientAddr, &len);
+            SOCKET ClientFd = accept(tcpSock_, (sockaddr *)&clientAddr, &len);
 
             if (ClientFd == INVALID_SOCKET)
             {
                 continue;
             }
 
-            std::thread(&IMServer::handleTcpClient, this, ClientFd).detach();
+            activeClients_++;
+            int64_t acceptedAt = traceEnabled() ? traceNow() : 0;
+            tcpWorkers_.post([this, ClientFd, acceptedAt] { handleTcpClient(ClientFd, acceptedAt); });
         }
-        closesocket(serverFd);
     }
 
     // read/write console writing from TCP socket.
@@ -220,8 +1712,31 @@ private:
         return sent == buf.size();
     }
 
-    void handleTcpClient(SOCKET fd)
+    static bool sendAll(SOCKET fd, const string &data)
+    {
+        const char *p = data.data();
+        size_t left = data.size();
+        while (left > 0)
+        {
+            int n = send(fd, p, (int)min<size_t>(left, 1 << 20), 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            left -= n;
+        }
+        return true;
+    }
+
+    void handleTcpClient(SOCKET fd, int64_t acceptedAt)
+    {
+        serveTcpClient(fd, acceptedAt);
+        activeClients_--;
+    }
+
+    // acceptedAt is only set when tracing is on
+    void serveTcpClient(SOCKET fd, int64_t acceptedAt)
     {
+        int64_t threadStart = acceptedAt ? traceNow() : 0;
         string req;
         if (!readLine(fd, req))
         {
@@ -229,6 +1744,16 @@ private:
             return;
         }
 
+        // "TRACE <id> <request>": time the stages of this request
+        uint64_t traceId = traceStripPrefix(req);
+        if (acceptedAt)
+        {
+            traceRecord(traceId, "server.spawn", acceptedAt, threadStart);
+            traceRecord(traceId, "server.readLine", threadStart, traceNow());
+        }
+        TraceContext traceContext(traceId);
+        TraceScope handleSpan("server.handle");
+
         istringstream iss(req);
         string cmd, userId, buddyId;
         iss >> cmd >> userId >> buddyId;
@@ -240,10 +1765,24 @@ private:
             else if (existingUser(userId))
                 sendLine(fd, CODE_USER_EXISTS);
             else if (registerUser(userId))
+            {
+                announceUsers({userId});
                 sendLine(fd, CODE_OK);
+            }
             else
                 sendLine(fd, CODE_INVALID);
         }
+        else if (cmd == "PEERREG")
+        {
+            // from a peer server sharing the data dir: "PEERREG <id>..."
+            istringstream items(req);
+            items >> cmd;
+            vector<string> ids;
+            for (string id; items >> id;)
+                ids.push_back(id);
+            addPeerUsers(ids);
+            sendLine(fd, CODE_OK);
+        }
         else if (cmd == "ADD" || cmd == "DEL")
         {
             bool isAdd = (cmd == "ADD");
@@ -253,11 +1792,164 @@ private:
                 sendLine(fd, CODE_NO_SUCH);
             else if (userId == buddyId)
                 sendLine(fd, CODE_INVALID);
-            else if (updateBuddyList(isAdd, userId, buddyId))
+            else if (updateBuddyList(isAdd, users_.intern(userId), users_.intern(buddyId)))
+                sendLine(fd, CODE_OK);
+            else
+                sendLine(fd, CODE_INVALID);
+        }
+        else if (cmd == "RELAY")
+        {
+            // the connection stays open as a relay session; see relaySession()
+            if (userId.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (!existingUser(userId))
+                sendLine(fd, CODE_NO_SUCH);
+            else
+            {
+                relaySession(fd, userId);
+                return;
+            }
+        }
+        else if (cmd == "RELAYFWD" || cmd == "RELAYGFWD")
+        {
+            // from a peer server: "RELAYFWD <from> <to> <text>" or
+            // "RELAYGFWD <group> <from> <text>". delivered to sessions on this
+            // server only and never forwarded again.
+            string text;
+            getline(iss >> ws, text);
+            if (userId.empty() || buddyId.empty() || text.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (cmd == "RELAYFWD")
+                sendLine(fd, relayDeliverLocal(buddyId, "FROM " + userId + " " + text + "\n") ? CODE_OK : CODE_NO_SUCH);
+            else
+            {
+                auto frame = make_shared<const string>("GROUP " + userId + " " + buddyId + " " + text + "\n");
+                relayGroupLocal(userId, users_.find(buddyId), frame);
+                sendLine(fd, CODE_OK);
+            }
+        }
+        else if (cmd == "SEND")
+        {
+            // SEND <from> <to> <text>: store a message for <to> to collect with FETCH
+            string text;
+            getline(iss >> ws, text);
+            if (userId.empty() || buddyId.empty() || text.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (!existingUser(userId) || !existingUser(buddyId))
+                sendLine(fd, CODE_NO_SUCH);
+            else if (offline_.enqueue(buddyId, userId, text))
                 sendLine(fd, CODE_OK);
             else
                 sendLine(fd, CODE_INVALID);
         }
+        else if (cmd == "FETCH")
+        {
+            // reply: "200 OK <n>" then n "<from> <text>" lines, oldest first.
+            // with n > 0 the messages are kept until the client answers ACK.
+            if (userId.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (!existingUser(userId))
+                sendLine(fd, CODE_NO_SUCH);
+            else
+                offline_.drain(
+                    userId,
+                    [&](size_t count) { return sendLine(fd, CODE_OK + " " + to_string(count)); },
+                    [&](const string &data) { return sendAll(fd, data); },
+                    [&] {
+                        DWORD timeout = FETCH_ACK_TIMEOUT_MS;
+                        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+                        string ack;
+                        return readLine(fd, ack) && ack == FETCH_ACK;
+                    });
+        }
+        else if (cmd == "WATCHERS" || cmd == "ONLINECOUNT")
+        {
+            // answered from the reverse index after the user file check.
+            // WATCHERS: "200 OK <n>" then n ids. ONLINECOUNT: "200 OK <n>"
+            UserHandle user = userId.empty() ? NO_USER : lookupRegisteredUser(userId);
+            if (userId.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (user == NO_USER)
+                sendLine(fd, CODE_NO_SUCH);
+            else if (cmd == "ONLINECOUNT")
+                sendLine(fd, CODE_OK + " " + to_string(onlineWatcherCount(user)));
+            else
+            {
+                vector<UserHandle> watchers;
+                getWatchers(user, watchers);
+                string reply = CODE_OK + " " + to_string(watchers.size()) + "\n";
+                for (auto w : watchers)
+                {
+                    reply += users_.name(w);
+                    reply += '\n';
+                }
+                sendAll(fd, reply);
+            }
+        }
+        else if (cmd == "MUTUAL")
+        {
+            // MUTUAL <a> <b>: "200 OK YES" if each has the other as a buddy
+            UserHandle a = userId.empty() ? NO_USER : lookupRegisteredUser(userId);
+            UserHandle b = buddyId.empty() ? NO_USER : lookupRegisteredUser(buddyId);
+            if (userId.empty() || buddyId.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (a == NO_USER || b == NO_USER)
+                sendLine(fd, CODE_NO_SUCH);
+            else
+                sendLine(fd, CODE_OK + (isMutual(a, b) ? " YES" : " NO"));
+        }
+        else if (cmd == "MADD" || cmd == "MDEL" || cmd == "MREG")
+        {
+            // bulk forms take a list of ids; the reply is "200 OK <n>" followed
+            // by one "<id> <code>" line per item, in request order
+            vector<string> ids;
+            if (cmd == "MREG" && !userId.empty())
+                ids.push_back(userId);
+            if (!buddyId.empty())
+                ids.push_back(buddyId);
+            for (string id; iss >> id;)
+                ids.push_back(id);
+
+            vector<const string *> codes;
+            bool ok = false;
+            if (ids.empty())
+                sendLine(fd, CODE_INVALID);
+            else if (cmd == "MREG")
+            {
+                // items are registered one by one and are not rolled back: a
+                // failed item leaves the ones before it registered, and its
+                // own line in the reply says what happened to it
+                vector<string> registered;
+                for (auto &id : ids)
+                {
+                    if (existingUser(id))
+                        codes.push_back(&CODE_USER_EXISTS);
+                    else if (registerUser(id))
+                    {
+                        codes.push_back(&CODE_OK);
+                        registered.push_back(id);
+                    }
+                    else
+                        codes.push_back(&CODE_INVALID);
+                }
+                announceUsers(registered);
+                ok = true;
+            }
+            else if (!existingUser(userId))
+                sendLine(fd, CODE_NO_SUCH);
+            else if (updateBuddyListBulk(cmd == "MADD", users_.intern(userId), userId, ids, codes))
+                ok = true;
+            else
+                sendLine(fd, CODE_INVALID);
+
+            if (ok)
+            {
+                string reply = CODE_OK + " " + to_string(ids.size()) + "\n";
+                for (size_t i = 0; i < ids.size(); i++)
+                    reply += ids[i] + " " + *codes[i] + "\n";
+                send(fd, reply.c_str(), (int)reply.size(), 0);
+            }
+        }
         else
         {
             sendLine(fd, CODE_INVALID);
@@ -266,24 +1958,223 @@ private:
         closesocket(fd);
     }
 
-    // UDP methods
+    // Relay methods
 
-    void udpLoop()
+    // serves one relay session until the client disconnects. client lines:
+    //   MSG <to> <text>      direct message; queued for FETCH if <to> has no session
+    //   JOIN <group>         LEAVE <group>
+    //   GMSG <group> <text>  message to every other member with a live session
+    // every command gets a status line back; relayed messages arrive as
+    //   FROM <from> <text>   and   GROUP <group> <from> <text>
+    void relaySession(SOCKET fd, const string &userId)
     {
-        SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP); // create UDP socket
+        UserHandle user = users_.intern(userId);
+        u_long nonBlocking = 1; // the fanout writers must never wait on this client
+        ioctlsocket(fd, FIONBIO, &nonBlocking);
+        auto session = make_shared<RelaySession>(fd, user);
+        {
+            lock_guard<mutex> lock(relayMutex_);
+            auto &slot = relaySessions_[user];
+            if (slot)
+                fanout_.close(*slot); // a newer login replaces the old session
+            slot = session;
+        }
+        relayReply(session, CODE_OK);
+
+        LineReader reader(fd);
+        string line;
+        while (reader.readLine(line))
+        {
+            istringstream iss(line);
+            string verb, target, text;
+            iss >> verb >> target;
+            getline(iss >> ws, text);
+
+            if (verb == "MSG")
+                relayDirect(session, userId, target, text);
+            else if (verb == "JOIN" || verb == "LEAVE")
+                relayMembership(session, verb == "JOIN", target);
+            else if (verb == "GMSG")
+                relayGroup(session, userId, target, text);
+            else
+                relayReply(session, CODE_INVALID);
+        }
+
+        {
+            lock_guard<mutex> lock(relayMutex_);
+            auto it = relaySessions_.find(user);
+            if (it != relaySessions_.end() && it->second == session)
+                relaySessions_.erase(it);
+        }
+        fanout_.close(*session);
+    }
+
+    void relayReply(const shared_ptr<RelaySession> &session, const string &code)
+    {
+        fanout_.post(session, make_shared<const string>(code + "\n"));
+    }
+
+    void relayDirect(const shared_ptr<RelaySession> &session, const string &from, const string &to, const string &text)
+    {
+        if (to.empty() || text.empty())
+            return relayReply(session, CODE_INVALID);
+        if (!existingUser(to))
+            return relayReply(session, CODE_NO_SUCH);
+
+        if (relayDeliverLocal(to, "FROM " + from + " " + text + "\n") ||
+            relayForward("RELAYFWD " + from + " " + to + " " + text, true))
+            relayReply(session, CODE_OK);
+        else if (offline_.enqueue(to, from, text))
+            relayReply(session, CODE_QUEUED);
+        else
+            relayReply(session, CODE_INVALID);
+    }
+
+    void relayMembership(const shared_ptr<RelaySession> &session, bool join, const string &group)
+    {
+        if (group.empty())
+            return relayReply(session, CODE_INVALID);
+        {
+            lock_guard<mutex> lock(relayMutex_);
+            auto &members = groups_[group];
+            auto it = find(members.begin(), members.end(), session->user);
+            if (join && it == members.end())
+                members.push_back(session->user);
+            else if (!join && it != members.end())
+                members.erase(it);
+            if (members.empty())
+                groups_.erase(group);
+        }
+        relayReply(session, CODE_OK);
+    }
+
+    void relayGroup(const shared_ptr<RelaySession> &session, const string &from, const string &group, const string &text)
+    {
+        if (group.empty() || text.empty())
+            return relayReply(session, CODE_INVALID);
+
+        {
+            lock_guard<mutex> lock(relayMutex_);
+            auto git = groups_.find(group);
+            if (git == groups_.end() ||
+                find(git->second.begin(), git->second.end(), session->user) == git->second.end())
+                return relayReply(session, CODE_INVALID); // not a member
+        }
+
+        // one shared frame for every recipient on this server; members whose
+        // sessions are on other backends get it through their server
+        auto frame = make_shared<const string>("GROUP " + group + " " + from + " " + text + "\n");
+        relayGroupLocal(group, session->user, frame);
+        relayForward("RELAYGFWD " + group + " " + from + " " + text, false);
+        relayReply(session, CODE_OK);
+    }
+
+    // queues frame for to's session on this server; false if it has none here
+    bool relayDeliverLocal(const string &to, const string &text)
+    {
+        shared_ptr<RelaySession> target;
+        {
+            lock_guard<mutex> lock(relayMutex_);
+            auto it = relaySessions_.find(users_.find(to));
+            if (it != relaySessions_.end())
+                target = it->second;
+        }
+        if (target)
+            fanout_.post(target, make_shared<const string>(text));
+        return target != nullptr;
+    }
+
+    // posts frame to every member of group with a session on this server,
+    // except the sender
+    void relayGroupLocal(const string &group, UserHandle sender, const shared_ptr<const string> &frame)
+    {
+        vector<shared_ptr<RelaySession>> targets;
+        {
+            lock_guard<mutex> lock(relayMutex_);
+            auto git = groups_.find(group);
+            if (git == groups_.end())
+                return;
+            targets.reserve(git->second.size());
+            for (auto member : git->second)
+            {
+                auto it = relaySessions_.find(member);
+                if (member != sender && it != relaySessions_.end())
+                    targets.push_back(it->second);
+            }
+        }
+        fanout_.postMany(targets.data(), targets.size(), frame);
+    }
+
+    // sends request to the peer servers in turn. with untilDelivered, stops at
+    // the first one that answers 200 and returns whether any did.
+    bool relayForward(const string &request, bool untilDelivered)
+    {
+        bool delivered = false;
+        for (auto &peer : relayPeers_)
+        {
+            string reply;
+            if (peerRequest(peer, request, reply) && reply == CODE_OK)
+            {
+                delivered = true;
+                if (untilDelivered)
+                    break;
+            }
+        }
+        return delivered;
+    }
+
+    // one request/reply with another backend; a peer that is down or slower
+    // than RELAY_PEER_TIMEOUT_MS is treated as not having the session
+    static bool peerRequest(const pair<string, int> &peer, const string &line, string &reply)
+    {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET)
+            return false;
+        DWORD timeout = RELAY_PEER_TIMEOUT_MS;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
 
-        // map to local address
         sockaddr_in addr{};
         addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(udpPort_);
+        addr.sin_port = htons(peer.second);
+        inet_pton(AF_INET, peer.first.c_str(), &addr.sin_addr);
+
+        bool ok = connect(s, (sockaddr *)&addr, sizeof(addr)) != SOCKET_ERROR && sendLine(s, line) && readLine(s, reply);
+        closesocket(s);
+        return ok;
+    }
+
+    void closeRelaySessions()
+    {
+        lock_guard<mutex> lock(relayMutex_);
+        for (auto &entry : relaySessions_)
+            fanout_.close(*entry.second);
+    }
+
+    // UDP methods
 
-        bind(sock, (sockaddr *)&addr, sizeof(addr));
+    void udpLoop()
+    {
+        SOCKET sock = udpSock_;
 
-        char buf[2048];
+        char stackBuf[2048];
+        char *buf = stackBuf;
+
+        // low-latency mode: this thread is the whole UDP path, so it gets the
+        // first listed core to itself and spins on the socket between packets
+        if (lowLatency_.enabled())
+        {
+            int cpu = lowLatency_.cpus[0];
+            lowLatencyPinThread(cpu);
+            if (char *local = (char *)lowLatencyAlloc(sizeof(stackBuf), lowLatencyNode(cpu)))
+                buf = local;
+        }
 
         while (!stop_)
         {
+            if (lowLatency_.enabled())
+                lowLatencyWaitReadable(sock, lowLatency_.spin);
+
             sockaddr_in clientAddr{};
             int len = sizeof(clientAddr);
             int n = recvfrom(sock, buf, 2047, 0, (sockaddr *)&clientAddr, &len);
@@ -306,7 +2197,9 @@ private:
                 if (!userId.empty() && msgPort > 0)
                 {
                     string status = statusCode + " " + statusMsg;
-                    if (status == ONLINE_STATUS || status == OFFLINE_STATUS || status == AWAY_STATUS)
+                    bool valid = status == ONLINE_STATUS || status == OFFLINE_STATUS || status == AWAY_STATUS;
+                    UserHandle user = valid ? lookupUser(userId) : NO_USER;
+                    if (user != NO_USER)
                     {
                         char ipbuf[INET_ADDRSTRLEN];
                         InetNtopA(AF_INET, &clientAddr.sin_addr, ipbuf, INET_ADDRSTRLEN);
@@ -316,7 +2209,7 @@ private:
                         rec.port = msgPort;
                         rec.status = status;
 
-                        updateUserStatus(userId, rec);
+                        updateUserStatus(user, rec);
                     }
                 }
             }
@@ -325,36 +2218,89 @@ private:
                 string userId;
                 iss >> userId;
 
-                if (!existingUser(userId))
+                UserHandle user = lookupUser(userId);
+                if (user == NO_USER)
                     continue;
 
-                auto buddies = readBuddyList(userId);
+                ArenaScope scope;
+                pmr::vector<UserHandle> buddies(scope.arena.resource());
+                uint64_t listVersion;
+                if (!getBuddies(user, buddies, listVersion))
+                    continue;
 
-                ostringstream reply;
+                pmr::string out(scope.arena.resource());
+                out.reserve(buddies.size() * 48);
                 for (size_t i = 0; i < buddies.size(); i++)
                 {
                     StatusRecord rec;
-                    if (getUserStatus(buddies[i], rec))
-                    {
-                        reply << buddies[i] << " "
-                              << rec.status << " "
-                              << rec.IPaddress << " "
-                              << rec.port;
-                    }
-                    else
+                    bool known = getUserStatus(buddies[i], rec);
+                    appendBuddyEntry(out, buddies[i], known ? &rec : nullptr);
+                    if (i + 1 == buddies.size())
+                        out.pop_back();
+                }
+                sendto(sock, out.c_str(), (int)out.size(), 0, (sockaddr *)&clientAddr, len);
+            }
+            else if (cmd == "GETP")
+            {
+                // GETP <user> <cursor> <since>: one page of the buddy list starting at
+                // index cursor. since = 0 asks for the full list; otherwise only buddies
+                // whose presence changed after version since are sent, unless the list
+                // itself changed, in which case the server falls back to a full listing.
+                // reply: "PAGE <FULL|DELTA> <version> <cursor> <next|END>" + entries
+                string userId;
+                size_t cursor = 0;
+                uint64_t since = 0;
+                iss >> userId >> cursor >> since;
+
+                UserHandle user = lookupUser(userId);
+                if (user == NO_USER)
+                    continue;
+
+                // read the clock first so a change racing with this reply shows up in the next delta
+                uint64_t version = presenceClock_.load();
+
+                ArenaScope scope;
+                pmr::vector<UserHandle> buddies(scope.arena.resource());
+                uint64_t listVersion;
+                if (!getBuddies(user, buddies, listVersion))
+                    continue;
+
+                // since > version means the client saw a previous server run
+                bool full = since == 0 || since < listVersion || since > version;
+
+                pmr::string body(scope.arena.resource());
+                size_t i = cursor;
+                for (; i < buddies.size(); i++)
+                {
+                    StatusRecord rec;
+                    bool known = getUserStatus(buddies[i], rec);
+                    if (!full && (!known || rec.version <= since))
+                        continue;
+
+                    size_t mark = body.size();
+                    appendBuddyEntry(body, buddies[i], known ? &rec : nullptr);
+                    if (body.size() > PAGE_BYTES && mark > 0)
                     {
-                        reply << buddies[i] << " "
-                              << OFFLINE_STATUS << " unknown unknown";
+                        body.resize(mark);
+                        break;
                     }
-                    if (i + 1 < buddies.size())
-                        reply << "\n";
                 }
-                string out = reply.str();
+
+                pmr::string out(scope.arena.resource());
+                out += "PAGE ";
+                out += full ? "FULL " : "DELTA ";
+                out += to_string(version);
+                out += ' ';
+                out += to_string(cursor);
+                out += ' ';
+                out += i < buddies.size() ? to_string(i) : "END";
+                out += '\n';
+                out += body;
                 sendto(sock, out.c_str(), (int)out.size(), 0, (sockaddr *)&clientAddr, len);
             }
         }
 
-        closesocket(sock);
+        udpStopped_ = true;
     }
 };
 
@@ -368,18 +2314,70 @@ int main(int argc, char* argv[])
     int udpPort = 1235;
     string dataDir = "data";
 
-    // Parse command line: im_server.exe <tcp_port> <udp_port> <data_dir>
+    int handoffPort = 0;
+    bool takeover = false;
+    string tracePath;
+    LowLatencyConfig lowLatency;
+    vector<pair<string, int>> relayPeers;
+
+    // Parse command line: im_server.exe <tcp_port> <udp_port> <data_dir> [--handoff-port N] [--takeover] [--trace file]
+    //                     [--low-latency cpus] [--spin-us N] [--relay-peers ip:port,ip:port,...]
     if (argc >= 2) tcpPort = atoi(argv[1]);
     if (argc >= 3) udpPort = atoi(argv[2]);
     if (argc >= 4) dataDir = argv[3];
+    for (int i = 4; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--handoff-port" && i + 1 < argc) handoffPort = atoi(argv[++i]);
+        else if (arg == "--takeover") takeover = true;
+        else if (arg == "--trace" && i + 1 < argc) tracePath = argv[++i];
+        else if (arg == "--low-latency" && i + 1 < argc)
+        {
+            if (!lowLatencyParseCpus(argv[++i], lowLatency.cpus))
+            {
+                cout << "[Server] Bad core list for --low-latency: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--spin-us" && i + 1 < argc) lowLatency.spin = chrono::microseconds(atoi(argv[++i]));
+        else if (arg == "--relay-peers" && i + 1 < argc)
+        {
+            istringstream peers(argv[++i]);
+            for (string peer; getline(peers, peer, ',');)
+            {
+                size_t colon = peer.rfind(':');
+                int port = colon == string::npos ? 0 : atoi(peer.c_str() + colon + 1);
+                if (port <= 0 || port > 65535)
+                {
+                    cout << "[Server] Bad --relay-peers entry: " << peer << "\n";
+                    return 1;
+                }
+                relayPeers.push_back({peer.substr(0, colon), port});
+            }
+        }
+    }
+    if (takeover && handoffPort <= 0)
+    {
+        cout << "[Server] --takeover needs --handoff-port\n";
+        return 1;
+    }
+    if (!tracePath.empty() && !traceStart(tracePath, "im_server " + to_string(tcpPort)))
+    {
+        cout << "[Server] Cannot write trace file " << tracePath << "\n";
+        return 1;
+    }
 
     cout << "[Server] Starting with TCP=" << tcpPort 
          << ", UDP=" << udpPort 
          << ", DataDir=" << dataDir << "\n";
 
-    IMServer server(tcpPort, udpPort, dataDir);
-    server.run();
+    if (lowLatency.enabled())
+        cout << "[Server] Low-latency mode: UDP thread on core " << lowLatency.cpus[0]
+             << ", spinning " << lowLatency.spin.count() << "us per receive\n";
+
+    IMServer server(tcpPort, udpPort, dataDir, handoffPort, lowLatency, relayPeers);
+    bool ok = server.run(takeover);
 
     WSACleanup();
-    return 0;
+    return ok ? 0 : 1;
 }
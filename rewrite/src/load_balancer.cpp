@@ -11,8 +11,27 @@
 #include <thread>
 #include <atomic>
 #include <string>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <deque>
+#include <latch>
+#include <unordered_set>
+#include <utility>
+#include <chrono>
+#include <cstdint>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "socket_handoff.h"
+#include "trace.h"
+#include "low_latency.h"
+#include "worker_pool.h"
 
 using namespace std;
+namespace fs = std::filesystem;
 
 
 // load balancer only serves as a middleman, so it only needs it's own ip + port (to serve as a
@@ -20,14 +39,234 @@ using namespace std;
 struct Backend{
     string ip;
     int port;
+    atomic<int> inflight{0}; // proxied connections currently using this backend
+    atomic<bool> draining{false}; // removed from the config; no new connections
+
+    Backend(const string& ip, int port): ip(ip), port(port) {}
+};
+
+// The live backend set. A reload builds a new table and publishes it with one
+// atomic pointer store; the accept path only does an atomic load, so it never
+// waits on a reload. (atomic<shared_ptr> would not do: libstdc++ implements it
+// with a lock.) Replaced tables are kept in retiredTables, since a reader may
+// still be walking one; reloads are rare and a table is a few pointers.
+// Connections hold a shared_ptr to their Backend, which keeps a removed backend
+// alive until its last connection finishes.
+struct BackendTable{
+    vector<shared_ptr<Backend>> backends;
+};
+
+atomic<const BackendTable*> backendTable{nullptr};
+vector<unique_ptr<const BackendTable>> retiredTables; // installBackends only
+
+// used when no config file is found
+static const vector<pair<string, int>> DEFAULT_BACKENDS = {
+    {"127.0.0.1", 5001},  // Server 1
+    {"127.0.0.1", 5002}   // Server 2
 };
 
+// how often the config file's modification time is checked
+static const auto CONFIG_POLL_INTERVAL = chrono::seconds(1);
+
 atomic<int> rrCounter{0};
 
-void forwardLoop(SOCKET src, SOCKET dst){
-    char buffer[4096];
+// admission control limits
+static const int MAX_ACTIVE_CONNECTIONS = 512;  // proxied at once, across all backends
+static const size_t MAX_QUEUED_CONNECTIONS = 256; // accepted, waiting for a free slot
+static const auto MAX_QUEUE_WAIT = chrono::seconds(2);
+static const auto QUEUE_SWEEP_INTERVAL = chrono::milliseconds(100);
+static const int MAX_BACKEND_INFLIGHT = 256;
+static const int MAX_RELAY_SESSIONS = 8192; // long-lived RELAY sessions, outside the caps above
+static const uint32_t RATE_PER_SEC = 50;  // new connections per source IP
+static const uint32_t RATE_BURST = 100;
+static const int MAX_CONNECTIONS_PER_IP = 32; // admitted at once per source IP, relay sessions aside
+static const int FIRST_BYTES_TIMEOUT_MS = 5000; // a client that sends nothing for this long is dropped
+
+// sent instead of proxying when a connection is shed
+static const string CODE_BUSY = "204 BUSY";
+
+static uint32_t nowMs(){
+    return (uint32_t)chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Per-source-IP token buckets. Each bucket is one atomic word holding
+// (milli-tokens << 32 | last refill ms) and is updated with a CAS loop, so the
+// accept path never locks. IPs are hashed onto a fixed table; IPs that collide
+// share a bucket, which keeps memory bounded at the cost of occasionally
+// limiting two sources together.
+class RateLimiter{
+public:
+    bool allow(uint32_t ip){
+        atomic<uint64_t>& bucket = buckets_[hashIp(ip) & (TABLE_SIZE - 1)];
+        uint32_t now = nowMs();
+        uint64_t cur = bucket.load(memory_order_relaxed);
+        while (true){
+            uint32_t tokens = BURST_MILLI;
+            if (cur != 0){
+                uint32_t elapsed = now - (uint32_t)cur; // wraps correctly
+                uint64_t refilled = (cur >> 32) + (uint64_t)elapsed * RATE_PER_SEC;
+                tokens = (uint32_t)min<uint64_t>(refilled, BURST_MILLI);
+            }
+            if (tokens < COST_MILLI) return false;
+            uint64_t next = ((uint64_t)(tokens - COST_MILLI) << 32) | now;
+            if (bucket.compare_exchange_weak(cur, next, memory_order_relaxed)) return true;
+        }
+    }
+
+private:
+    static const size_t TABLE_SIZE = 16384; // power of two
+    static const uint32_t COST_MILLI = 1000;
+    static const uint32_t BURST_MILLI = RATE_BURST * COST_MILLI;
+
+    static uint32_t hashIp(uint32_t ip){
+        ip ^= ip >> 16;
+        ip *= 0x45d9f3b;
+        ip ^= ip >> 16;
+        return ip;
+    }
+
+    atomic<uint64_t> buckets_[TABLE_SIZE] = {};
+};
+
+RateLimiter rateLimiter;
+
+// connections each source IP holds: queued, waiting for its request or being
+// proxied. the rate limit alone would let one IP fill every slot with silent
+// sockets within seconds. hashed like the rate limiter, so colliding IPs share
+// a count.
+class IpConnectionLimit{
+public:
+    bool acquire(uint32_t ip){
+        atomic<int>& count = counts_[hashIp(ip) & (TABLE_SIZE - 1)];
+        if (count.fetch_add(1, memory_order_relaxed) < MAX_CONNECTIONS_PER_IP) return true;
+        count.fetch_sub(1, memory_order_relaxed);
+        return false;
+    }
+
+    void release(uint32_t ip){
+        counts_[hashIp(ip) & (TABLE_SIZE - 1)].fetch_sub(1, memory_order_relaxed);
+    }
+
+private:
+    static const size_t TABLE_SIZE = 16384; // power of two
+
+    static uint32_t hashIp(uint32_t ip){
+        ip ^= ip >> 16;
+        ip *= 0x45d9f3b;
+        ip ^= ip >> 16;
+        return ip;
+    }
+
+    atomic<int> counts_[TABLE_SIZE] = {};
+};
+
+IpConnectionLimit ipConnections;
+
+// slots for proxied connections. claiming one is a single fetch_add; only when
+// the cap is reached does a connection go through the waiting queue's mutex.
+atomic<int> activeConnections{0};
+atomic<uint64_t> shedConnections{0};
+
+struct QueuedClient{
+    SOCKET sock;
+    chrono::steady_clock::time_point since;
+    uint32_t ip; // holds one ipConnections count until the client is done
+};
+deque<QueuedClient> waitQueue;
+mutex waitMutex;
+
+// fixed-size object pool: objects are carved out of slabs of SlotsPerSlab and
+// recycled through a free list, so connection churn reuses the same memory
+// instead of fragmenting the heap. slabs are never returned to the OS. with a
+// NUMA node set, new slabs are allocated on that node.
+template <typename T, size_t SlotsPerSlab = 64>
+class SlabPool{
+public:
+    template <typename... Args>
+    T* create(Args&&... args){
+        Slot* slot;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!freeList_) grow();
+            slot = freeList_;
+            freeList_ = slot->next;
+        }
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* obj){
+        obj->~T();
+        Slot* slot = reinterpret_cast<Slot*>(obj);
+        lock_guard<mutex> lock(mutex_);
+        slot->next = freeList_;
+        freeList_ = slot;
+    }
+
+    void setNumaNode(int node){
+        lock_guard<mutex> lock(mutex_);
+        numaNode_ = node;
+    }
+
+private:
+    union Slot{
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void grow(){
+        Slot* slab = nullptr;
+        if (numaNode_ >= 0) slab = (Slot*)lowLatencyAlloc(sizeof(Slot) * SlotsPerSlab, numaNode_);
+        if (!slab){
+            slabs_.push_back(make_unique<Slot[]>(SlotsPerSlab));
+            slab = slabs_.back().get();
+        }
+        for (size_t i = 0; i < SlotsPerSlab; i++){
+            slab[i].next = freeList_;
+            freeList_ = &slab[i];
+        }
+    }
+
+    mutex mutex_;
+    Slot* freeList_ = nullptr;
+    vector<unique_ptr<Slot[]>> slabs_; // heap slabs; node-local ones are never freed
+    int numaNode_ = -1;
+};
+
+// per-connection state, including both I/O buffers, lives in one pooled slot
+struct Connection{
+    static constexpr size_t BUF_SIZE = 4096;
+
+    SOCKET clientSock;
+    Backend* backend;
+    char upBuf[BUF_SIZE];   // client -> backend
+    char downBuf[BUF_SIZE]; // backend -> client
+
+    Connection(SOCKET s, Backend* b): clientSock(s), backend(b) {}
+};
+
+SlabPool<Connection> connectionPool;
+
+// threads for handleClient and for each flow's backend -> client direction,
+// reused across connections. never destroyed, since idle workers may still be
+// waiting on it at exit. in low-latency mode a worker stays pinned to the last
+// core a flow gave it until its next flow pins it again.
+WorkerPool& workers = *new WorkerPool();
+
+// low-latency mode (--low-latency): each proxied connection takes the next two
+// listed cores round-robin, one per forwarding thread, so the two spinning
+// directions of a flow never compete for a core. with one core listed, both
+// run there and only the reply direction spins.
+LowLatencyConfig lowLatency;
+atomic<unsigned> nextLowLatencyCpu{0};
+
+// cpu is the core this direction is pinned to, or -1 outside low-latency mode.
+// spin: poll src for lowLatency.spin before each blocking recv.
+void forwardLoop(SOCKET src, SOCKET dst, char* buffer, int bufSize, int cpu, bool spin){
+    if (cpu >= 0) lowLatencyPinThread(cpu);
     while (true){
-        int n = recv(src, buffer, sizeof(buffer), 0);
+        if (spin) lowLatencyWaitReadable(src, lowLatency.spin);
+        int n = recv(src, buffer, bufSize, 0);
         if (n <= 0) break;
         int sent = send(dst, buffer, n, 0);
         if (sent <= 0) break;
@@ -36,9 +275,226 @@ void forwardLoop(SOCKET src, SOCKET dst){
     shutdown(src, SD_RECEIVE);
 }
 
+// reject a connection without proxying it
+void shed(SOCKET clientSock){
+    string line = CODE_BUSY + "\n";
+    send(clientSock, line.c_str(), (int)line.size(), 0);
+    closesocket(clientSock);
+
+    uint64_t n = ++shedConnections;
+    if (n % 1000 == 1) cout << "\n[LB] Overloaded, shed " << n << " connection(s) so far";
+}
+
+// sheds an admitted client and gives back its per-IP count
+void shedClient(const QueuedClient& client){
+    shed(client.sock);
+    ipConnections.release(client.ip);
+}
+
+// round-robin over backends, skipping any at their in-flight limit.
+// returns nullptr when every backend is full.
+shared_ptr<Backend> acquireBackend(){
+    const BackendTable* table = backendTable.load(memory_order_acquire);
+    auto& backends = table->backends;
+    if (backends.empty()) return nullptr;
+    int start = rrCounter++;
+    for (size_t i = 0; i < backends.size(); i++){
+        const shared_ptr<Backend>& b = backends[(start + i) % backends.size()];
+        int cur = b->inflight.load(memory_order_relaxed);
+        while (cur < MAX_BACKEND_INFLIGHT){
+            if (b->inflight.compare_exchange_weak(cur, cur + 1)) return b;
+        }
+    }
+    return nullptr;
+}
+
+void releaseBackend(Backend& backend){
+    if (--backend.inflight == 0 && backend.draining){
+        cout << "\n[LB] Backend drained: " << backend.ip << ":" << backend.port;
+    }
+}
+
+// config file: one "<ip> <port>" per line, '#' starts a comment.
+// returns false if the file cannot be read, has a malformed line or lists no
+// backends, so a bad edit never replaces a working table.
+bool readBackendConfig(const string& path, vector<pair<string, int>>& out){
+    ifstream ifs(path);
+    if (!ifs) return false;
+
+    string line;
+    while (getline(ifs, line)){
+        line = line.substr(0, line.find('#'));
+        istringstream ls(line);
+        string ip;
+        int port = 0;
+        if (!(ls >> ip)) continue;
+        in_addr addr;
+        if (!(ls >> port) || port <= 0 || port > 65535 || inet_pton(AF_INET, ip.c_str(), &addr) != 1){
+            cout << "\n[LB] Bad backend line in " << path << ": " << line;
+            return false;
+        }
+        out.push_back({ip, port});
+    }
+    if (out.empty()){
+        cout << "\n[LB] No backends listed in " << path;
+        return false;
+    }
+    return true;
+}
+
+// builds a table for entries and publishes it. backends present in both the old
+// and new config keep their state; removed ones are marked draining.
+void installBackends(const vector<pair<string, int>>& entries){
+    const BackendTable* old = backendTable.load(memory_order_relaxed);
+    auto table = make_unique<BackendTable>();
+
+    for (auto& [ip, port]: entries){
+        shared_ptr<Backend> backend;
+        if (old){
+            for (auto& b: old->backends){
+                if (b->ip == ip && b->port == port) backend = b;
+            }
+        }
+        if (!backend) backend = make_shared<Backend>(ip, port);
+        table->backends.push_back(backend);
+    }
+    backendTable.store(table.get(), memory_order_release);
+
+    if (old){
+        for (auto& b: old->backends){
+            bool kept = false;
+            for (auto& nb: table->backends) kept |= (nb == b);
+            if (kept) continue;
+            b->draining = true;
+            cout << "\n[LB] Draining backend " << b->ip << ":" << b->port
+                 << " (" << b->inflight.load() << " in flight)";
+            if (b->inflight == 0) cout << "\n[LB] Backend drained: " << b->ip << ":" << b->port;
+        }
+    }
+
+    cout << "\n[LB] Forwarding to " << table->backends.size() << " backend(s)\n";
+    for (size_t i = 0; i < table->backends.size(); i++){
+        cout << "[LB]   Backend " << i << ": " << table->backends[i]->ip << ":" << table->backends[i]->port << "\n";
+    }
+    retiredTables.push_back(move(table)); // the live one is kept here too
+}
+
+atomic<bool> reloadRequested{false};
+
+#ifdef SIGHUP
+void onSighup(int){
+    reloadRequested = true;
+}
+#endif
+
+// reloads the config when its modification time changes or on SIGHUP (where the
+// platform has one). a config that fails to parse leaves the current table live.
+void configWatchLoop(string path){
+    error_code ec;
+    auto lastWrite = fs::last_write_time(path, ec);
+
+    while (true){
+        this_thread::sleep_for(CONFIG_POLL_INTERVAL);
+
+        auto mtime = fs::last_write_time(path, ec);
+        bool changed = !ec && mtime != lastWrite;
+        if (!changed && !reloadRequested.exchange(false)) continue;
+        if (!ec) lastWrite = mtime;
+
+        vector<pair<string, int>> entries;
+        if (!readBackendConfig(path, entries)){
+            cout << "\n[LB] Config reload failed, keeping current backends";
+            continue;
+        }
+        cout << "\n[LB] Reloading backends from " << path;
+        installBackends(entries);
+    }
+}
+
 // connect client to availible backend
 
-void handleClient(SOCKET clientSock, const Backend& backend){
+static int64_t toTraceNs(chrono::steady_clock::time_point t){
+    return chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+// relay sessions stay open for a whole login. they run outside the active
+// slot and backend in-flight caps, which are sized for short requests, so
+// logged in users never starve one-shot requests of slots.
+atomic<int> relaySessions{0};
+static const string RELAY_REQUEST = "RELAY ";
+
+// client sockets of the open relay sessions. after a handoff they are shut
+// down, so clients reopen their sessions through the replacement and this
+// process can drain.
+mutex relaySocketsMutex;
+unordered_set<SOCKET> relaySockets;
+bool relaySocketsClosed = false;
+
+// false once closeRelaySessions ran; the session must end at once
+bool trackRelaySocket(SOCKET s){
+    lock_guard<mutex> lock(relaySocketsMutex);
+    if (relaySocketsClosed) return false;
+    relaySockets.insert(s);
+    return true;
+}
+
+void untrackRelaySocket(SOCKET s){
+    lock_guard<mutex> lock(relaySocketsMutex);
+    relaySockets.erase(s);
+}
+
+void closeRelaySessions(){
+    lock_guard<mutex> lock(relaySocketsMutex);
+    relaySocketsClosed = true;
+    for (SOCKET s : relaySockets) shutdown(s, SD_BOTH);
+}
+
+QueuedClient nextQueuedClient();
+void handleClient(QueuedClient client);
+
+// what the balancer needs from the start of a request
+struct RequestHead{
+    uint64_t traceId = 0;
+    bool relay = false;
+};
+
+// waits up to FIRST_BYTES_TIMEOUT_MS for the client's first bytes and peeks at
+// them for a "TRACE <id>" prefix and for RELAY. the bytes stay queued and are
+// forwarded untouched. false if the client sent nothing in time or hung up;
+// no backend is held meanwhile.
+bool readRequestHead(Connection* conn, chrono::steady_clock::time_point acceptedAt, RequestHead& head){
+    int64_t peekStart = traceEnabled() ? traceNow() : 0;
+    WSAPOLLFD pfd{};
+    pfd.fd = conn->clientSock;
+    pfd.events = POLLRDNORM;
+    if (WSAPoll(&pfd, 1, FIRST_BYTES_TIMEOUT_MS) <= 0) return false;
+    int n = recv(conn->clientSock, conn->upBuf, (int)Connection::BUF_SIZE, MSG_PEEK);
+    if (n <= 0) return false;
+
+    string first(conn->upBuf, n);
+    head.traceId = traceStripPrefix(first);
+    head.relay = first.compare(0, RELAY_REQUEST.size(), RELAY_REQUEST) == 0;
+    if (head.traceId){
+        traceRecord(head.traceId, "lb.admit", toTraceNs(acceptedAt), peekStart);
+        traceRecord(head.traceId, "lb.readRequest", peekStart, traceNow());
+    }
+    return true;
+}
+
+// returns true for a relay session, whose active slot, backend in-flight count
+// and per-IP count were handed back once it was established
+bool proxyClient(Connection* conn, const QueuedClient& client, const RequestHead& head){
+    SOCKET clientSock = conn->clientSock;
+    Backend& backend = *conn->backend;
+    uint64_t traceId = head.traceId;
+    bool relay = head.relay;
+    if (relay && relaySessions.fetch_add(1) >= MAX_RELAY_SESSIONS){
+        relaySessions--;
+        shed(clientSock);
+        return false;
+    }
+
+    int64_t connectStart = traceId ? traceNow() : 0;
     SOCKET backendSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     sockaddr_in backendAddr{};
     backendAddr.sin_family = AF_INET;
@@ -52,75 +508,303 @@ void handleClient(SOCKET clientSock, const Backend& backend){
             << " WSAError=" << WSAGetLastError();
         closesocket(clientSock);
         closesocket(backendSock);
-        return;
+        if (relay) relaySessions--;
+        return false;
 }
+    if (traceId) traceRecord(traceId, "lb.connect", connectStart, traceNow());
+
+    int upCpu = -1, downCpu = -1;
+    if (lowLatency.enabled()){
+        unsigned k = nextLowLatencyCpu.fetch_add(2);
+        downCpu = lowLatency.cpus[k % lowLatency.cpus.size()];
+        upCpu = lowLatency.cpus[(k + 1) % lowLatency.cpus.size()];
+        int opt = 1;
+        for (SOCKET s : {clientSock, backendSock})
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt));
+    }
+    if (relay){
+        // give the slot to the next queued client (or free it) and stop counting
+        // against the backend and the IP; this thread now only serves the session
+        releaseBackend(backend);
+        ipConnections.release(client.ip);
+        QueuedClient next = nextQueuedClient();
+        if (next.sock != INVALID_SOCKET) workers.post([next]{ handleClient(next); });
+        if (!trackRelaySocket(clientSock)) shutdown(clientSock, SD_BOTH);
+    }
+    TraceScope proxySpan(traceId, "lb.proxy");
 
 
     cout << "\n Client Connected to Load Balancer. " << backend.ip << ":" << backend.port;
     
-    // back and forth data flow
-    thread t1(forwardLoop, clientSock, backendSock);
-    thread t2(forwardLoop, backendSock, clientSock);
+    // back and forth data flow (this thread carries the client -> backend direction)
+    latch downDone(1);
+    workers.post([&]{
+        forwardLoop(backendSock, clientSock, conn->downBuf, (int)Connection::BUF_SIZE, downCpu, downCpu >= 0);
+        downDone.count_down();
+    });
+    forwardLoop(clientSock, backendSock, conn->upBuf, (int)Connection::BUF_SIZE, upCpu, upCpu >= 0 && upCpu != downCpu);
 
-    t1.join();
-    t2.join();
+    downDone.wait();
 
+    if (relay) untrackRelaySocket(clientSock);
     closesocket(clientSock);
     closesocket(backendSock);
+    if (relay) relaySessions--;
 
     cout << "[LB] Connection closed\n";
+    return relay;
+}
+
+// hands the finishing thread's slot to the oldest queued client, or frees it.
+// clients that waited longer than MAX_QUEUE_WAIT are shed instead.
+QueuedClient nextQueuedClient(){
+    lock_guard<mutex> lock(waitMutex);
+    while (!waitQueue.empty()){
+        QueuedClient next = waitQueue.front();
+        waitQueue.pop_front();
+        if (chrono::steady_clock::now() - next.since <= MAX_QUEUE_WAIT) return next;
+        shedClient(next);
+    }
+    activeConnections--;
+    return {INVALID_SOCKET, {}, 0};
+}
+
+// runs on its own thread while holding one active slot. once a client is
+// done, the thread keeps the slot and serves queued clients until none are left.
+// a relay session passes the slot on when it starts, and the thread ends with it.
+void handleClient(QueuedClient client){
+    while (client.sock != INVALID_SOCKET){
+        Connection* conn = connectionPool.create(client.sock, nullptr);
+        RequestHead head;
+        shared_ptr<Backend> backend;
+        if (!readRequestHead(conn, client.since, head)){
+            closesocket(client.sock);
+        }
+        else if (!(backend = acquireBackend())){
+            shed(client.sock);
+        }
+        else{
+            conn->backend = backend.get();
+            if (proxyClient(conn, client, head)){
+                // its slot, backend and IP counts were passed on when the session started
+                connectionPool.destroy(conn);
+                return;
+            }
+            releaseBackend(*backend);
+        }
+        connectionPool.destroy(conn);
+        ipConnections.release(client.ip);
+        client = nextQueuedClient();
+    }
+}
+
+// sheds queued clients whose wait ran out. slots only free up when a handler
+// finishes, so without this a client queued behind long-lived sessions would
+// never hear back. the queue is in arrival order, so expired clients are at
+// the front; they are shed outside the lock.
+void queueSweepLoop(){
+    vector<QueuedClient> expired;
+    while (true){
+        this_thread::sleep_for(QUEUE_SWEEP_INTERVAL);
+        {
+            lock_guard<mutex> lock(waitMutex);
+            auto deadline = chrono::steady_clock::now() - MAX_QUEUE_WAIT;
+            while (!waitQueue.empty() && waitQueue.front().since < deadline){
+                expired.push_back(waitQueue.front());
+                waitQueue.pop_front();
+            }
+        }
+        for (auto& client : expired) shedClient(client);
+        expired.clear();
+    }
+}
+
+// claims an active slot for a new client that holds a per-IP count. if the cap
+// is reached the client waits in the queue, or is shed when the queue is full too.
+void admitClient(SOCKET clientSock, uint32_t ip){
+    QueuedClient client{clientSock, chrono::steady_clock::now(), ip};
+    if (activeConnections.fetch_add(1) < MAX_ACTIVE_CONNECTIONS){
+        workers.post([client]{ handleClient(client); });
+        return;
+    }
+    activeConnections--;
+
+    // slow path: re-check under the lock so a slot freed meanwhile is not missed
+    unique_lock<mutex> lock(waitMutex);
+    if (activeConnections.fetch_add(1) < MAX_ACTIVE_CONNECTIONS){
+        lock.unlock();
+        workers.post([client]{ handleClient(client); });
+        return;
+    }
+    activeConnections--;
+    if (waitQueue.size() >= MAX_QUEUED_CONNECTIONS){
+        lock.unlock();
+        shedClient(client);
+        return;
+    }
+    waitQueue.push_back(client);
 }
 
 
+// set once the listening socket has been handed to a replacement process
+atomic<bool> handedOff{false};
+
+// waits for a replacement process (started with --takeover) and gives it the
+// listening socket. this process then stops accepting and exits once its
+// proxied connections have finished.
+void handoffLoop(int port, SOCKET listenSock){
+    SOCKET ctlListen = handoffListen(port);
+    if (ctlListen == INVALID_SOCKET){
+        cout << "\n[LB] Cannot listen for handoff on port " << port;
+        return;
+    }
+    cout << "\n[LB] Accepting handoff requests on 127.0.0.1:" << port;
+
+    while (true){
+        SOCKET ctl = accept(ctlListen, nullptr, nullptr);
+        if (ctl == INVALID_SOCKET) continue;
+
+        DWORD pid;
+        if (!handoffReadRequest(ctl, pid) || !handoffSendSocket(ctl, listenSock, pid)){
+            cout << "\n[LB] Handoff attempt failed";
+            closesocket(ctl);
+            continue;
+        }
+
+        // frees the control port for the replacement's own listener
+        closesocket(ctlListen);
+        closesocket(ctl);
+
+        handedOff = true;
+        closesocket(listenSock); // the replacement's duplicate keeps it listening
+        return;
+    }
+}
+
 // run load balancer
 
-int main(){
+int main(int argc, char* argv[]){
     WSADATA wsa;
     WSAStartup(MAKEWORD(2,2), &wsa);
 
-    vector<Backend> backends = {
-        {"127.0.0.1", 5001},  // Server 1
-        {"127.0.0.1", 5002}   // Server 2
-    };
+    // Parse command line: load_balancer.exe [backends_config] [--handoff-port N] [--takeover] [--trace file]
+    //                     [--low-latency cpus] [--spin-us N]
+    string configPath = "backends.conf";
+    string tracePath;
+    int handoffPort = 0;
+    bool takeover = false;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "--handoff-port" && i + 1 < argc) handoffPort = atoi(argv[++i]);
+        else if (arg == "--takeover") takeover = true;
+        else if (arg == "--trace" && i + 1 < argc) tracePath = argv[++i];
+        else if (arg == "--low-latency" && i + 1 < argc){
+            if (!lowLatencyParseCpus(argv[++i], lowLatency.cpus)){
+                cout << "[LB] Bad core list for --low-latency: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--spin-us" && i + 1 < argc) lowLatency.spin = chrono::microseconds(atoi(argv[++i]));
+        else configPath = arg;
+    }
+    if (takeover && handoffPort <= 0){
+        cout << "[LB] --takeover needs --handoff-port\n";
+        return 1;
+    }
+    if (!tracePath.empty() && !traceStart(tracePath, "load_balancer")){
+        cout << "[LB] Cannot write trace file " << tracePath << "\n";
+        return 1;
+    }
+    if (lowLatency.enabled()){
+        // connection buffers live next to the cores that forward them
+        connectionPool.setNumaNode(lowLatencyNode(lowLatency.cpus[0]));
+        cout << "[LB] Low-latency mode on " << lowLatency.cpus.size() << " core(s), spinning "
+            << lowLatency.spin.count() << "us per receive\n";
+    }
 
-    SOCKET listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    vector<pair<string, int>> entries;
+    if (readBackendConfig(configPath, entries)){
+        cout << "[LB] Loaded backends from " << configPath;
+    }
+    else{
+        cout << "[LB] No usable config at " << configPath << ", using built-in backends";
+        entries = DEFAULT_BACKENDS;
+    }
+    installBackends(entries);
 
-    int opt = 1;
-    setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+#ifdef SIGHUP
+    signal(SIGHUP, onSighup);
+#endif
+    thread(configWatchLoop, configPath).detach();
+    thread(queueSweepLoop).detach();
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(1234);
+    SOCKET listenSock;
+    if (takeover){
+        // inherit the running balancer's listening socket instead of binding
+        SOCKET ctl = handoffConnect(handoffPort);
+        listenSock = INVALID_SOCKET;
+        if (ctl != INVALID_SOCKET){
+            if (handoffSendRequest(ctl)) listenSock = handoffRecvSocket(ctl);
+            closesocket(ctl);
+        }
+        if (listenSock == INVALID_SOCKET){
+            cout << "[LB] Takeover failed, no listener received on handoff port " << handoffPort << "\n";
+            return 1;
+        }
+        cout << "[LB] Took over listening socket from previous process\n";
+    }
+    else{
+        listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
-    
+        int opt = 1;
+        setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
 
-    if (bind(listenSock, (sockaddr*)&addr, sizeof(addr)) < 0) {
-    cout << "LB bind failed!\n";
-        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(1234);
+
+        
 
-    listen(listenSock, SOMAXCONN);
+        if (bind(listenSock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        cout << "LB bind failed!\n";
+            }
+
+        listen(listenSock, SOMAXCONN);
+    }
 
     cout << "[LB] Load Balancer running on port 1234...\n";
 
-    while (true){
+    if (handoffPort > 0) thread(handoffLoop, handoffPort, listenSock).detach();
+
+    while (!handedOff){
         sockaddr_in ClientAddr{};
         int len = sizeof(ClientAddr);
 
         SOCKET clientSock = accept(listenSock, (sockaddr*)&ClientAddr, &len);
         if (clientSock == INVALID_SOCKET) continue;
 
-        // backend selector (set to red-robin)
-        int idx = rrCounter++ % backends.size();
-        Backend backend = backends[idx];
+        uint32_t ip = ClientAddr.sin_addr.s_addr;
+        if (!rateLimiter.allow(ip) || !ipConnections.acquire(ip)){
+            shed(clientSock);
+            continue;
+        }
 
-        cout << "\nLoad Balancer: New Client routes to backend # " << idx << " " 
-        << backend.ip << ":" << backend.port << "\n";
-        
-        thread(&handleClient, clientSock, backend).detach();
+        // backend selector (red-robin) runs once the client holds a slot and
+        // has sent its first bytes
+        admitClient(clientSock, ip);
+    }
+
+    // handed off: the replacement accepts from here on; finish what we proxy
+    // and send relay clients to the replacement
+    closeRelaySessions();
+    cout << "\n[LB] Listener handed off, waiting for " << activeConnections.load() + relaySessions.load()
+         << " connection(s) to finish\n";
+    while (activeConnections > 0 || relaySessions > 0){
+        this_thread::sleep_for(chrono::milliseconds(100));
     }
+    cout << "[LB] Drained, exiting\n";
 
-    closesocket(listenSock);
     WSACleanup();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,103 @@
+// Opt-in low-latency mode shared by im_server and load_balancer.
+//
+// Started with --low-latency <cpus> (e.g. "2,3" or "2-5"), a process pins its
+// I/O threads to those cores and busy-polls its sockets: before each blocking
+// receive it polls the socket without blocking for up to --spin-us
+// microseconds (default 50), so a reply that is about to arrive is picked up
+// without the thread being put to sleep and woken again. Past the budget the
+// receive blocks as usual, so idle connections do not burn a core.
+//
+// Buffers for the pinned threads come from the NUMA node of the first listed
+// core, so list cores from one node.
+//
+// This trades CPU for tail latency and is off by default.
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct LowLatencyConfig
+{
+    std::vector<int> cpus; // empty: low-latency mode off
+    std::chrono::microseconds spin{50};
+
+    bool enabled() const { return !cpus.empty(); }
+};
+
+// parses "2,3" or "2-5" (or a mix). false if the list is malformed or names
+// a core past the 64 an affinity mask can hold.
+inline bool lowLatencyParseCpus(const std::string &list, std::vector<int> &out)
+{
+    out.clear();
+    std::istringstream iss(list);
+    std::string item;
+    while (std::getline(iss, item, ','))
+    {
+        size_t dash = item.find('-');
+        char *end;
+        long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (end == item.c_str())
+            return false;
+        if (dash != std::string::npos)
+            last = std::strtol(item.c_str() + dash + 1, &end, 10);
+        if (*end != '\0' || first < 0 || last < first || last >= 64)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            out.push_back((int)cpu);
+    }
+    return !out.empty();
+}
+
+// pins the calling thread to one core
+inline bool lowLatencyPinThread(int cpu)
+{
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+}
+
+// NUMA node a core belongs to, 0 if unknown
+inline int lowLatencyNode(int cpu)
+{
+    UCHAR node = 0;
+    if (!GetNumaProcessorNode((UCHAR)cpu, &node) || node == 0xff)
+        return 0;
+    return node;
+}
+
+// page-aligned memory on the given NUMA node, falling back to any node. never
+// freed by callers here; the buffers live as long as the process.
+inline void *lowLatencyAlloc(size_t bytes, int node)
+{
+    void *p = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT,
+                                 PAGE_READWRITE, (DWORD)node);
+    if (!p)
+        p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return p;
+}
+
+// spins until s is readable or the budget runs out, so a blocking receive
+// right after returns at once in the common case. returns true if readable.
+inline bool lowLatencyWaitReadable(SOCKET s, std::chrono::microseconds spin)
+{
+    auto deadline = std::chrono::steady_clock::now() + spin;
+    WSAPOLLFD pfd{};
+    pfd.fd = s;
+    pfd.events = POLLRDNORM;
+    do
+    {
+        pfd.revents = 0;
+        if (WSAPoll(&pfd, 1, 0) != 0) // ready, or an error the receive will report
+            return true;
+        YieldProcessor();
+    } while (std::chrono::steady_clock::now() < deadline);
+    return false;
+}
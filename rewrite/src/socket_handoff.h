@@ -0,0 +1,206 @@
+// Hot-upgrade support shared by im_server and load_balancer.
+//
+// A running process started with --handoff-port N listens on 127.0.0.1:N for
+// its replacement. The new binary is started with the same port plus
+// --takeover; it connects, sends "TAKEOVER <pid>", and receives the old
+// process's listening sockets. Winsock has no SCM_RIGHTS, so each socket is
+// duplicated into the new process with WSADuplicateSocket and sent as a
+// WSAPROTOCOL_INFO record. Since the listening sockets never close, clients
+// never see connection refused during the switch.
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+static const std::string HANDOFF_REQUEST = "TAKEOVER";
+static const std::string HANDOFF_BAD_REQUEST = "400 BAD HANDOFF REQUEST";
+static const size_t HANDOFF_MAX_LINE = 64; // the TAKEOVER request line
+static const std::string HANDOFF_END = "END";  // ends the server's presence snapshot
+
+inline bool handoffSendAll(SOCKET s, const char *data, int len)
+{
+    while (len > 0)
+    {
+        int n = send(s, data, len, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool handoffRecvAll(SOCKET s, char *data, int len)
+{
+    while (len > 0)
+    {
+        int n = recv(s, data, len, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// reads the TAKEOVER request, a byte at a time so nothing past it is
+// consumed. false on disconnect, or if the line grows past HANDOFF_MAX_LINE.
+inline bool handoffReadLine(SOCKET s, std::string &out)
+{
+    out.clear();
+    char c;
+    while (true)
+    {
+        int n = recv(s, &c, 1, 0);
+        if (n <= 0)
+            return false;
+        if (c == '\n')
+            break;
+        if (c != '\r')
+            out.push_back(c);
+        if (out.size() > HANDOFF_MAX_LINE)
+            return false;
+    }
+    return true;
+}
+
+// buffered reader for what follows the sockets: the server's presence
+// snapshot, one line per known user, ending with HANDOFF_END. lines have no
+// length limit, since user ids do not; the sender is the previous process.
+class HandoffLineReader
+{
+public:
+    explicit HandoffLineReader(SOCKET s) : sock_(s) {}
+
+    // false once the connection ends
+    bool next(std::string &out)
+    {
+        out.clear();
+        while (true)
+        {
+            size_t nl = buf_.find('\n', pos_);
+            if (nl != std::string::npos)
+            {
+                out.assign(buf_, pos_, nl - pos_);
+                pos_ = nl + 1;
+                if (!out.empty() && out.back() == '\r')
+                    out.pop_back();
+                return true;
+            }
+            buf_.erase(0, pos_);
+            pos_ = 0;
+            char chunk[4096];
+            int n = recv(sock_, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                return false;
+            buf_.append(chunk, n);
+        }
+    }
+
+private:
+    SOCKET sock_;
+    std::string buf_;
+    size_t pos_ = 0;
+};
+
+// control listener for the replacement process, loopback only. the previous
+// process may still hold the port for a moment after a handoff, so binding
+// is retried for a few seconds.
+inline SOCKET handoffListen(int port)
+{
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    for (int attempt = 0; attempt < 50; attempt++)
+    {
+        if (bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(sock, 1) == 0)
+            return sock;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    closesocket(sock);
+    return INVALID_SOCKET;
+}
+
+inline SOCKET handoffConnect(int port)
+{
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// old process side: waits for "TAKEOVER <pid>" on an accepted control
+// connection. anything else gets an error line back and false; the caller
+// keeps running and waits for the next request.
+inline bool handoffReadRequest(SOCKET ctl, DWORD &pid)
+{
+    std::string line;
+    if (!handoffReadLine(ctl, line))
+        return false;
+
+    const std::string prefix = HANDOFF_REQUEST + " ";
+    uint32_t value = 0;
+    bool valid = line.compare(0, prefix.size(), prefix) == 0;
+    if (valid)
+    {
+        const char *first = line.data() + prefix.size();
+        const char *last = line.data() + line.size();
+        auto [end, ec] = std::from_chars(first, last, value);
+        valid = ec == std::errc() && end == last && first != last && value != 0;
+    }
+    if (!valid)
+    {
+        std::string reply = HANDOFF_BAD_REQUEST + "\n";
+        handoffSendAll(ctl, reply.c_str(), (int)reply.size());
+        return false;
+    }
+    pid = (DWORD)value;
+    return true;
+}
+
+// new process side
+inline bool handoffSendRequest(SOCKET ctl)
+{
+    std::string line = HANDOFF_REQUEST + " " + std::to_string(GetCurrentProcessId()) + "\n";
+    return handoffSendAll(ctl, line.c_str(), (int)line.size());
+}
+
+// duplicates sock into process pid and sends the record over ctl
+inline bool handoffSendSocket(SOCKET ctl, SOCKET sock, DWORD pid)
+{
+    WSAPROTOCOL_INFOA info{};
+    if (WSADuplicateSocketA(sock, pid, &info) != 0)
+        return false;
+    return handoffSendAll(ctl, (const char *)&info, sizeof(info));
+}
+
+// opens the socket described by the next record on ctl
+inline SOCKET handoffRecvSocket(SOCKET ctl)
+{
+    WSAPROTOCOL_INFOA info{};
+    if (!handoffRecvAll(ctl, (char *)&info, sizeof(info)))
+        return INVALID_SOCKET;
+    return WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, 0);
+}
@@ -0,0 +1,301 @@
+// Opt-in request tracing shared by im_client, load_balancer and im_server.
+//
+// A traced TCP request starts with "TRACE <id> " in front of the usual command
+// line. Each process started with --trace <file> records how long every stage of
+// that request took, tagged with the id, and writes the spans to <file> in
+// Chrome trace-event JSON (open it in chrome://tracing or ui.perfetto.dev). All
+// timestamps come from steady_clock, which is system-wide on both Windows
+// (QueryPerformanceCounter) and Linux (CLOCK_MONOTONIC), so files from the three
+// processes line up when merged:
+//
+//     jq -s add client.json lb.json server*.json > run.json
+//
+// Recording never blocks: spans go into a bounded lock-free ring, and a dumper
+// thread drains it to the file once a second. If the ring fills up, spans are
+// dropped and counted rather than slowing requests down.
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+static const std::string TRACE_PREFIX = "TRACE ";
+
+struct TraceSpan
+{
+    uint64_t traceId;
+    const char *stage; // string literal
+    int64_t startNs;
+    int64_t durNs;
+    uint32_t tid;
+};
+
+// Bounded multi-producer queue (Vyukov). Each slot's sequence number says whose
+// turn it is: producers claim a slot with one CAS on head_, the single consumer
+// (the dumper) frees it by advancing the sequence by a full lap.
+class TraceRing
+{
+public:
+    static const size_t CAPACITY = 1 << 16; // power of two
+
+    TraceRing()
+    {
+        for (size_t i = 0; i < CAPACITY; i++)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const TraceSpan &span)
+    {
+        uint64_t pos = head_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot &slot = slots_[pos & (CAPACITY - 1)];
+            int64_t diff = (int64_t)slot.seq.load(std::memory_order_acquire) - (int64_t)pos;
+            if (diff == 0)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    slot.span = span;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false; // full
+            }
+            else
+            {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer side, dumper thread only
+    bool pop(TraceSpan &out)
+    {
+        Slot &slot = slots_[tail_ & (CAPACITY - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1)
+            return false;
+        out = slot.span;
+        slot.seq.store(tail_ + CAPACITY, std::memory_order_release);
+        tail_++;
+        return true;
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> seq;
+        TraceSpan span;
+    };
+
+    Slot slots_[CAPACITY];
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) uint64_t tail_ = 0;
+    std::atomic<uint64_t> dropped_{0};
+};
+
+struct TraceState
+{
+    TraceRing ring;
+    std::ofstream out;
+    std::streampos end; // where the next event goes; the closing "]" follows it
+    bool first = true;
+    uint64_t droppedReported = 0;
+    uint32_t pid = 0;
+    std::mutex dumpMutex;
+};
+
+// set once by traceStart; the state is only allocated for traced processes
+inline std::atomic<TraceState *> traceStateRef{nullptr};
+
+inline bool traceEnabled()
+{
+    return traceStateRef.load(std::memory_order_acquire) != nullptr;
+}
+
+inline int64_t traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline uint32_t traceThreadId()
+{
+    static std::atomic<uint32_t> next{1};
+    thread_local uint32_t id = next.fetch_add(1);
+    return id;
+}
+
+// the trace a thread is currently serving, so deep helpers can record spans
+// without passing the id around. set with TraceContext.
+inline uint64_t &traceCurrentId()
+{
+    thread_local uint64_t id = 0;
+    return id;
+}
+
+inline void traceRecord(uint64_t traceId, const char *stage, int64_t startNs, int64_t endNs)
+{
+    TraceState *st = traceStateRef.load(std::memory_order_acquire);
+    if (traceId == 0 || !st)
+        return;
+    st->ring.push({traceId, stage, startNs, endNs - startNs, traceThreadId()});
+}
+
+// records the enclosing scope as one span of the current trace
+class TraceScope
+{
+public:
+    explicit TraceScope(const char *stage) : TraceScope(traceCurrentId(), stage) {}
+    TraceScope(uint64_t traceId, const char *stage)
+        : traceId_(traceId), stage_(stage), start_(traceId != 0 && traceEnabled() ? traceNow() : 0) {}
+    ~TraceScope()
+    {
+        if (start_ != 0)
+            traceRecord(traceId_, stage_, start_, traceNow());
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    uint64_t traceId_;
+    const char *stage_;
+    int64_t start_;
+};
+
+class TraceContext
+{
+public:
+    explicit TraceContext(uint64_t traceId) : saved_(traceCurrentId()) { traceCurrentId() = traceId; }
+    ~TraceContext() { traceCurrentId() = saved_; }
+
+private:
+    uint64_t saved_;
+};
+
+// strips a leading "TRACE <id> " from a request line and returns the id, or 0
+// when the line is not traced. ids are hex.
+inline uint64_t traceStripPrefix(std::string &line)
+{
+    if (line.compare(0, TRACE_PREFIX.size(), TRACE_PREFIX) != 0)
+        return 0;
+    size_t idEnd = line.find(' ', TRACE_PREFIX.size());
+    if (idEnd == std::string::npos)
+        return 0;
+    uint64_t id = std::strtoull(line.c_str() + TRACE_PREFIX.size(), nullptr, 16);
+    line.erase(0, idEnd + 1);
+    return id;
+}
+
+inline std::string traceFormatPrefix(uint64_t traceId)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%llx ", (unsigned long long)traceId);
+    return TRACE_PREFIX + buf;
+}
+
+// a new id, unique across processes in practice: pid in the high bits
+inline uint64_t traceNewId()
+{
+    static std::atomic<uint32_t> counter{0};
+    return ((uint64_t)GetCurrentProcessId() << 32) | (counter.fetch_add(1) + 1);
+}
+
+// Dumping
+
+inline void traceWriteEvent(TraceState &st, const std::string &json)
+{
+    st.out.seekp(st.end);
+    st.out << (st.first ? "\n" : ",\n") << json;
+    st.first = false;
+    st.end = st.out.tellp();
+    st.out << "\n]\n"; // keeps the file valid JSON between dumps
+}
+
+// moves everything recorded so far into the file
+inline void traceFlush()
+{
+    TraceState *state = traceStateRef.load(std::memory_order_acquire);
+    if (!state)
+        return;
+    TraceState &st = *state;
+    std::lock_guard<std::mutex> lock(st.dumpMutex);
+
+    TraceSpan span;
+    char buf[256];
+    bool wrote = false;
+    while (st.ring.pop(span))
+    {
+        std::snprintf(buf, sizeof(buf),
+                      "{\"name\":\"%s\",\"cat\":\"im\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"pid\":%u,\"tid\":%u,\"args\":{\"trace\":\"%llx\"}}",
+                      span.stage, span.startNs / 1000.0, span.durNs / 1000.0,
+                      st.pid, span.tid, (unsigned long long)span.traceId);
+        traceWriteEvent(st, buf);
+        wrote = true;
+    }
+
+    // a counter track shows when the ring overflowed
+    uint64_t dropped = st.ring.dropped();
+    if (dropped != st.droppedReported)
+    {
+        st.droppedReported = dropped;
+        std::snprintf(buf, sizeof(buf),
+                      "{\"name\":\"dropped spans\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%u,\"args\":{\"spans\":%llu}}",
+                      traceNow() / 1000.0, st.pid, (unsigned long long)dropped);
+        traceWriteEvent(st, buf);
+        wrote = true;
+    }
+    if (wrote)
+        st.out.flush();
+}
+
+// enables tracing and starts the dumper. processName labels this process in
+// the viewer.
+inline bool traceStart(const std::string &path, const std::string &processName)
+{
+    if (traceEnabled())
+        return false;
+
+    TraceState *st = new TraceState(); // never freed; the dumper runs until exit
+    st->out.open(path, std::ios::out | std::ios::trunc);
+    if (!st->out)
+    {
+        delete st;
+        return false;
+    }
+    st->pid = (uint32_t)GetCurrentProcessId();
+    st->out << "[";
+    st->end = st->out.tellp();
+    traceWriteEvent(*st, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(st->pid) +
+                             ",\"args\":{\"name\":\"" + processName + "\"}}");
+    st->out.flush();
+    traceStateRef.store(st, std::memory_order_release);
+
+    std::thread([] {
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            traceFlush();
+        }
+    }).detach();
+    return true;
+}
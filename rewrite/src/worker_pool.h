@@ -0,0 +1,79 @@
+// Reusable connection threads shared by im_server and load_balancer.
+//
+// Both processes serve a connection on a thread of its own, since their
+// handlers block on sockets. Starting a std::thread per connection costs a
+// stack and, in the server, a fresh thread-local request arena every time.
+// A WorkerPool thread that finishes a job instead waits up to its idle
+// timeout for the next one, so under churn the same threads, stacks and
+// arenas serve connection after connection. A job posted while every thread
+// is busy starts a new thread, so blocking jobs never wait on each other.
+// At most maxIdle threads wait at once; the rest exit when their job ends.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class WorkerPool
+{
+public:
+    explicit WorkerPool(std::chrono::milliseconds idleTimeout = std::chrono::seconds(30), size_t maxIdle = 256)
+        : idleTimeout_(idleTimeout), maxIdle_(maxIdle)
+    {
+    }
+
+    // runs job on an idle thread, or on a new one if none is idle. threads
+    // are detached, so the pool must outlive them; the processes keep theirs
+    // for their whole run.
+    void post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if (idle_ > 0)
+            {
+                idle_--; // this waiter is taken; it pops the job when it wakes
+                jobs_.push_back(std::move(job));
+                cv_.notify_one();
+                return;
+            }
+        }
+        std::thread(&WorkerPool::workerLoop, this, std::move(job)).detach();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+private:
+    void workerLoop(std::function<void()> job)
+    {
+        while (true)
+        {
+            job();
+            job = nullptr;
+
+            std::unique_lock<std::mutex> lock(m_);
+            if (idle_ >= maxIdle_)
+                return;
+            idle_++;
+            if (!cv_.wait_for(lock, idleTimeout_, [this] { return !jobs_.empty(); }))
+            {
+                idle_--; // no post counted on this thread
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+    }
+
+    std::chrono::milliseconds idleTimeout_;
+    size_t maxIdle_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+    size_t idle_ = 0; // waiting threads not yet handed a job
+};